@@ -0,0 +1,422 @@
+#include "lib.cpp"
+#include "events.cpp"
+#include "concurrency.cpp"
+#include "output.cpp"
+#include "shards.cpp"
+#include <deque>
+#include <chrono>
+#include <fstream>
+#include <thread>
+
+//replays events.in against each book backend (run from the directory containing events.in)
+//parsing is done once up front so only the book operations are timed
+
+const int DEPTH_WALKS = 10000;
+
+std::vector<Event> loadEvents(const char* path) {
+    std::ifstream in(path);
+    std::vector<Event> events;
+    std::string type, data;
+    Event e;
+    while (in >> type >> data) {
+        if (parseEvent(type, data, e) != INVALID_EVENT) events.push_back(e);
+    }
+    return events;
+}
+
+long long msSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+long long usSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+template<class Ins>
+std::unordered_map<std::string, Ins> makeInstruments(std::vector<Event> const& events) {
+    std::unordered_map<std::string, Ins> instruments;
+    for (auto const& e : events) {
+        if (!instruments.contains(e.order.symbol)) instruments.emplace(e.order.symbol, Ins(e.order.symbol));
+    }
+    return instruments;
+}
+
+template<class Ins>
+void replay(std::unordered_map<std::string, Ins>& instruments, std::vector<Event> const& events) {
+    for (auto const& e : events) {
+        auto& ins = instruments[e.order.symbol];
+        switch (e.type) {
+            case NEW_ORDER:
+                ins.addOrder(e.order);
+                break;
+            case ORDER_CANCELED:
+                ins.removeOrder(e.order.id, e.order.exchTime);
+                break;
+            case ORDER_EXECUTED:
+                ins.executeOrder(e.order.id, e.order.qty, e.order.exchTime);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+template<class Ins>
+void benchBackend(const char* name, std::vector<Event> const& events, std::size_t retainLevels = 0, timestamp retainAge = 0) {
+    auto instruments = makeInstruments<Ins>(events);
+    for (auto& [sym, ins] : instruments) ins.setLevelRetention(retainLevels, retainAge);
+
+    auto start = std::chrono::steady_clock::now();
+    replay(instruments, events);
+    auto replayMs = msSince(start);
+
+    //full depth walks over the final books
+    start = std::chrono::steady_clock::now();
+    long long volume = 0;
+    for (int i = 0; i < DEPTH_WALKS; i++) {
+        for (auto& [sym, ins] : instruments) {
+            ins.forEachLevel(B, [&](PriceLevel const& pl) { volume += pl.volume; });
+            ins.forEachLevel(S, [&](PriceLevel const& pl) { volume += pl.volume; });
+        }
+    }
+    auto walkMs = msSince(start);
+
+    std::size_t created = 0, reused = 0;
+    for (auto& [sym, ins] : instruments) {
+        created += ins.getLevelStats().created;
+        reused += ins.getLevelStats().reused;
+    }
+
+    std::cout << name << ": replay " << replayMs << " ms, " << DEPTH_WALKS << " depth walks " << walkMs << " ms (checksum " << volume << "), "
+        << created << " levels created, " << reused << " reused\n";
+}
+
+//L1 sinks: the same work done through a compile-time sink and through FunctionSink's pointer
+std::size_t l1Count = 0;
+RingBuffer<L1Datum> sinkBuffer(1000);
+
+struct CountingSink {
+    void operator()(L1Datum const&) const {
+        l1Count++;
+    }
+};
+
+struct RingBufferSink {
+    void operator()(L1Datum const& L1d) const {
+        sinkBuffer.add(L1d);
+    }
+};
+
+void countL1(L1Datum) {
+    l1Count++;
+}
+
+void bufferL1(L1Datum L1d) {
+    sinkBuffer.add(L1d);
+}
+
+template<class Sink>
+void benchSink(const char* name, std::vector<Event> const& events, void(*callback)(L1Datum) = nullptr) {
+    auto instruments = makeInstruments<BasicInstrument<MapBookPolicy, Sink>>(events);
+    if constexpr (std::same_as<Sink, FunctionSink>) {
+        for (auto& [sym, ins] : instruments) ins.setCallback(callback);
+    }
+    l1Count = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    replay(instruments, events);
+    std::cout << name << ": replay " << usSince(start) << " us\n";
+}
+
+//writer hand-off throughput: one producer thread pushing HANDOFF_UPDATES L1 updates to one consumer thread
+const std::size_t HANDOFF_UPDATES = 1000000;
+const std::size_t HANDOFF_BUFFER = 1024;
+
+//RingBuffer + mutex + semaphores, the way main handed off updates before SpscRing (overwrites when full)
+void benchLockedHandoff() {
+    RingBuffer<L1Datum> buffer(HANDOFF_BUFFER);
+    std::counting_semaphore<HANDOFF_BUFFER> filled{0};
+    std::mutex manip;
+    std::atomic<bool> done = false;
+    std::size_t received = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread consumer([&]() {
+        while (true) {
+            filled.acquire();
+            std::lock_guard<std::mutex> g(manip);
+            if (buffer.count() == 0) {
+                if (done) return;
+                continue;
+            }
+            buffer.get();
+            received++;
+        }
+    });
+    for (std::size_t i = 0; i < HANDOFF_UPDATES; i++) {
+        std::lock_guard<std::mutex> g(manip);
+        if (buffer.add(L1Datum{i, {}, {}, {}, 0})) filled.release();
+    }
+    {
+        std::lock_guard<std::mutex> g(manip);
+        done = true;
+        filled.release();
+    }
+    consumer.join();
+    std::cout << "mutex + semaphore hand-off: " << msSince(start) << " ms, received " << received << "/" << HANDOFF_UPDATES << "\n";
+}
+
+//blockSize > 1 pushes blocks of that many updates at once, the way a BookWorker flushes
+void benchSpscHandoff(std::size_t blockSize = 1) {
+    SpscRing<L1Datum> ring(HANDOFF_BUFFER);
+    std::size_t received = 0;
+    timestamp checksum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread consumer([&]() {
+        L1Datum L1d;
+        while (true) {
+            if (ring.tryPop(L1d)) {
+                received++;
+                checksum += L1d.exchTime;
+            } else if (ring.closed()) {
+                while (ring.tryPop(L1d)) received++;
+                return;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+    std::vector<L1Datum> block;
+    for (std::size_t i = 0; i < HANDOFF_UPDATES; i += blockSize) {
+        block.clear();
+        for (std::size_t j = i; j < std::min(i + blockSize, HANDOFF_UPDATES); j++) block.push_back(L1Datum{j, {}, {}, {}, 0});
+        std::span<const L1Datum> rest(block);
+        while (!rest.empty()) {
+            auto n = blockSize == 1 ? (std::size_t) ring.tryPush(rest[0]) : ring.tryPush(rest);
+            if (n == 0) std::this_thread::yield();
+            rest = rest.subspan(n);
+        }
+    }
+    ring.close();
+    consumer.join();
+    std::cout << "SPSC ring hand-off" << (blockSize > 1 ? ", blocks of " + std::to_string(blockSize) : "") << ": "
+        << msSince(start) << " ms, received " << received << "/" << HANDOFF_UPDATES << "\n";
+}
+
+//writer wake-up latency: a producer pushing one timestamped update every WAIT_GAP_US, the consumer recording
+//how long each took to reach it under a WaitPolicy
+const std::size_t WAIT_UPDATES = 5000;
+const int WAIT_GAP_US = 50;
+
+void benchWaitLatency(WaitPolicy policy) {
+    SpscRing<L1Datum> ring(HANDOFF_BUFFER);
+    WakeSignal wake;
+    std::vector<long long> latencies;
+    latencies.reserve(WAIT_UPDATES);
+    auto epoch = std::chrono::steady_clock::now();
+    auto nsSinceEpoch = [&]() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    };
+
+    std::thread consumer([&]() {
+        Waiter waiter(policy, wake);
+        L1Datum L1d;
+        while (true) {
+            if (ring.tryPop(L1d)) {
+                latencies.push_back(nsSinceEpoch() - (long long) L1d.exchTime);
+                waiter.reset();
+            } else if (ring.closed()) {
+                return;
+            } else {
+                waiter.idle([&]() { return ring.peek() != nullptr || ring.closed(); });
+            }
+        }
+    });
+    for (std::size_t i = 0; i < WAIT_UPDATES; i++) {
+        std::this_thread::sleep_for(std::chrono::microseconds(WAIT_GAP_US));
+        while (!ring.tryPush(L1Datum{(timestamp) nsSinceEpoch(), {}, {}, {}, 0})) std::this_thread::yield();
+        wake.notify();
+    }
+    ring.close();
+    wake.notify();
+    consumer.join();
+
+    std::sort(latencies.begin(), latencies.end());
+    auto pct = [&](double p) { return latencies[std::min(latencies.size() - 1, (std::size_t) (p * latencies.size()))]; };
+    std::cout << "wake-up latency, " << to_string(policy) << ": p50 " << pct(0.5) << " ns, p99 " << pct(0.99) << " ns, p99.9 " << pct(0.999)
+        << " ns, max " << latencies.back() << " ns\n";
+}
+
+//per-event symbol -> id lookup, done LOOKUP_PASSES times over the loaded events
+const int LOOKUP_PASSES = 20;
+
+void benchSymbolLookup(std::vector<Event> const& events) {
+    std::unordered_map<std::string, symbol_id> byName;
+    SymbolKeyIndex byKey;
+    for (auto const& e : events) {
+        if (e.type == BATCH_END || byName.count(e.order.symbol)) continue;
+        byName[e.order.symbol] = byName.size();
+        byKey.insert(e.symbolKey, byName[e.order.symbol]);
+    }
+
+    uint64_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < LOOKUP_PASSES; pass++) {
+        for (auto const& e : events) checksum += byName.find(e.order.symbol)->second;
+    }
+    std::cout << "symbol lookup, unordered_map<string>: " << msSince(start) << " ms (checksum " << checksum << ")\n";
+
+    checksum = 0;
+    start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < LOOKUP_PASSES; pass++) {
+        for (auto const& e : events) checksum += byKey.find(e.symbolKey);
+    }
+    std::cout << "symbol lookup, packed key: " << msSince(start) << " ms (checksum " << checksum << ")\n";
+}
+
+//sharded replay: the loaded events routed by the calling thread to shardCount BookShards, the way main does with shards.count,
+//while a writer thread drains their L1; symbols are balanced on their message counts over the whole run
+//with a core each for the parser, the writer and every shard, throughput should grow close to linearly with shardCount
+using BenchBook = std::variant<BasicInstrument<MapBookPolicy, WriteBufferSink>>;
+
+void benchShards(std::vector<Event> const& events, std::size_t shardCount) {
+    SymbolTable table;
+    std::vector<std::size_t> counts;
+    for (auto const& e : events) {
+        if (e.type == TRADE || e.type == BATCH_END) continue;
+        auto id = table.intern(e.order.symbol);
+        if (id >= counts.size()) counts.resize(id + 1);
+        counts[id]++;
+    }
+
+    MultiSpscQueue<L1Datum> queue(shardCount, HANDOFF_BUFFER);
+    OverflowStats stats;
+    std::vector<L1Outbox> outboxes;
+    for (std::size_t s = 0; s < shardCount; s++) outboxes.emplace_back(queue.producer(s), OverflowPolicy::BLOCK, stats);
+    WakeSignal wake;
+    std::vector<std::unique_ptr<BookShard<BenchBook>>> shards;
+    for (std::size_t s = 0; s < shardCount; s++) {
+        shards.push_back(std::make_unique<BookShard<BenchBook>>(4096));
+        shards.back()->worker.producer = s;
+        shards.back()->worker.link = {&queue, &outboxes[s], nullptr, nullptr, &wake};
+    }
+    std::deque<BenchBook> books;
+    std::vector<BookShard<BenchBook>*> shardOf;
+    auto assigned = balanceShards(table.size(), counts, shardCount);
+    for (symbol_id id = 0; id < table.size(); id++) {
+        books.emplace_back(std::in_place_index<0>, table.name(id), id);
+        shards[assigned[id]]->worker.assign(books.back());
+        shardOf.push_back(shards[assigned[id]].get());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<timestamp> parsedUpTo{0};
+    std::vector<std::thread> threads;
+    for (auto& shard : shards) threads.emplace_back([&, s = shard.get()]() { s->run(parsedUpTo); });
+    std::size_t received = 0;
+    std::thread writer([&]() {
+        Waiter waiter(WaitPolicy::SPIN_YIELD, wake);
+        L1Datum L1d;
+        while (true) {
+            if (queue.tryPop(L1d)) {
+                received++;
+                waiter.reset();
+            } else if (queue.closed()) {
+                while (queue.tryPop(L1d)) received++;
+                return;
+            } else {
+                waiter.idle([&]() { return !queue.empty() || queue.closed(); });
+            }
+        }
+    });
+
+    for (auto const& e : events) {
+        if (e.type == TRADE) continue;
+        if (e.type == BATCH_END) {
+            for (auto& shard : shards) shard->push({e, nullptr});
+            continue;
+        }
+        auto id = *table.find(e.order.symbol);
+        shardOf[id]->push({e, &books[id]});
+        if (e.order.exchTime != parsedUpTo.load(std::memory_order_relaxed)) {
+            parsedUpTo.store(e.order.exchTime, std::memory_order_release);
+            for (auto& shard : shards) shard->wakeUp();
+        }
+    }
+    for (auto& shard : shards) shard->close();
+    for (auto& thread : threads) thread.join();
+    writer.join();
+
+    auto us = std::max<long long>(usSince(start), 1);
+    std::cout << "sharded replay, " << shardCount << " shard" << (shardCount == 1 ? "" : "s") << ": " << us / 1000 << " ms, "
+        << events.size() * 1000000 / us << " events/s, " << received << " L1 updates\n";
+}
+
+//l1.out formatting: CSV_ROWS rows written to csv_bench.out, then removed
+const std::size_t CSV_ROWS = 2000000;
+
+//to_string + concatenation + ofstream, the way main wrote l1.out before L1CsvWriter
+void benchStreamCsv(SymbolTable const& table) {
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::ofstream out("csv_bench.out");
+        for (std::size_t i = 0; i < CSV_ROWS; i++) {
+            L1Datum L1d{i, {1000000 + (int) (i % 5000), 1010000}, {100, 200}, {1, 1}, (symbol_id) (i % table.size())};
+            using namespace std;
+            out << to_string(L1d.exchTime) + "," + table.name(L1d.symbolId) + "," + to_string(L1d.price[0]) + ","
+                + to_string(L1d.volume[0]) + "," + to_string(L1d.price[1]) + "," + to_string(L1d.volume[1]) << "\n";
+        }
+    }
+    std::cout << "CSV via ofstream: " << msSince(start) << " ms for " << CSV_ROWS << " rows\n";
+}
+
+void benchBufferedCsv(SymbolTable const& table, bool fixedPoint, bool mapped = false) {
+    auto start = std::chrono::steady_clock::now();
+    {
+        L1CsvWriter out("csv_bench.out", table, fixedPoint, 4 << 20, mapped);
+        for (std::size_t i = 0; i < CSV_ROWS; i++) {
+            out.write(L1Datum{i, {1000000 + (int) (i % 5000), 1010000}, {100, 200}, {1, 1}, (symbol_id) (i % table.size())});
+        }
+    }
+    std::cout << "CSV via L1CsvWriter" << (fixedPoint ? ", fixed point" : "") << (mapped ? ", mmap" : "") << ": " << msSince(start) << " ms for " << CSV_ROWS << " rows\n";
+}
+
+int main() {
+    std::ios::sync_with_stdio(false);
+
+    auto start = std::chrono::steady_clock::now();
+    auto events = loadEvents("events.in");
+    std::cout << "loaded " << events.size() << " events in " << msSince(start) << " ms\n";
+
+    benchBackend<Instrument>("std::map", events);
+    benchBackend<VectorInstrument>("sorted vector", events);
+    //keep up to 8 emptied levels per side for up to 1s
+    benchBackend<Instrument>("std::map, level retention", events, 8, 1000000);
+    benchBackend<VectorInstrument>("sorted vector, level retention", events, 8, 1000000);
+
+    benchSink<CountingSink>("trivial sink, inlined", events);
+    benchSink<FunctionSink>("trivial sink, function pointer", events, &countL1);
+    benchSink<RingBufferSink>("ring buffer sink, inlined", events);
+    benchSink<FunctionSink>("ring buffer sink, function pointer", events, &bufferL1);
+
+    benchSymbolLookup(events);
+
+    benchLockedHandoff();
+    benchSpscHandoff();
+    benchSpscHandoff(64);
+
+    benchWaitLatency(WaitPolicy::SPIN);
+    benchWaitLatency(WaitPolicy::SPIN_YIELD);
+    benchWaitLatency(WaitPolicy::SPIN_PARK);
+
+    for (std::size_t shards = 1; shards <= 4; shards *= 2) benchShards(events, shards);
+
+    SymbolTable table;
+    for (char c = 'A'; c <= 'Z'; c++) table.intern(std::string(1, c));
+    benchStreamCsv(table);
+    benchBufferedCsv(table, false);
+    benchBufferedCsv(table, true);
+    benchBufferedCsv(table, false, true);
+    std::remove("csv_bench.out");
+}
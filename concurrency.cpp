@@ -0,0 +1,543 @@
+#pragma once
+#include "lib.cpp"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <string>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+//lock-free building blocks for handing book output to other threads
+
+const std::size_t CACHE_LINE = 64;
+
+//spin-wait hint; keeps a busy loop from starving the sibling hyperthread
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+
+//latest-value slot: a single writer overwrites it wait-free, readers on any thread retry until they get a consistent copy
+//the value is copied word by word through relaxed atomics so the racing reads are well-defined
+template<class T>
+class alignas(CACHE_LINE) SeqlockSlot final {
+    static_assert(std::is_trivially_copyable_v<T>);
+    static const std::size_t WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    public:
+        void store(T const& value) {
+            uint64_t words[WORDS] = {};
+            std::memcpy(words, &value, sizeof(T));
+            auto s = seq.load(std::memory_order_relaxed);
+            seq.store(s + 1, std::memory_order_relaxed); //odd while writing
+            std::atomic_thread_fence(std::memory_order_release);
+            for (std::size_t i = 0; i < WORDS; i++) data[i].store(words[i], std::memory_order_relaxed);
+            seq.store(s + 2, std::memory_order_release);
+        }
+
+        //false if nothing has been stored yet
+        bool load(T& out) const {
+            uint64_t words[WORDS];
+            while (true) {
+                auto s = seq.load(std::memory_order_acquire);
+                if (s & 1) {
+                    cpuRelax();
+                    continue;
+                }
+                for (std::size_t i = 0; i < WORDS; i++) words[i] = data[i].load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (seq.load(std::memory_order_relaxed) != s) continue;
+                if (s == 0) return false;
+                std::memcpy(&out, words, sizeof(T));
+                return true;
+            }
+        }
+
+        //number of stores so far; lets a reader skip copying when nothing changed
+        uint64_t version() const {
+            return seq.load(std::memory_order_acquire) / 2;
+        }
+    private:
+        std::atomic<uint64_t> seq{0};
+        std::atomic<uint64_t> data[WORDS] = {};
+};
+
+//one SeqlockSlot per symbol id holding that symbol's latest L1, for readers that only care about the current state
+//producer cost is constant however slow (or many) the readers are
+//the table is sized up front since readers index it without a lock; updates for ids past it are rejected and counted
+class ConflatedL1 final {
+    public:
+        explicit ConflatedL1(std::size_t maxSymbols) : slots(new SeqlockSlot<L1Datum>[maxSymbols]), capacity(maxSymbols) {}
+
+        //book threads only (each with its own symbols); false for a symbol id past the table
+        bool publish(L1Datum const& L1d) {
+            if (L1d.symbolId >= capacity) {
+                rejectedUpdates.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            slots[L1d.symbolId].store(L1d);
+            return true;
+        }
+
+        //any thread; false if the symbol has no L1 yet
+        bool latest(symbol_id id, L1Datum& out) const {
+            return id < capacity && slots[id].load(out);
+        }
+
+        uint64_t version(symbol_id id) const {
+            return id < capacity ? slots[id].version() : 0;
+        }
+
+        std::size_t size() const {
+            return capacity;
+        }
+
+        //updates publish() turned away
+        uint64_t rejected() const {
+            return rejectedUpdates.load(std::memory_order_relaxed);
+        }
+    private:
+        std::unique_ptr<SeqlockSlot<L1Datum>[]> slots;
+        std::size_t capacity;
+        std::atomic<uint64_t> rejectedUpdates{0};
+};
+
+//wait-free single-producer/single-consumer ring; capacity is rounded up to a power of two
+//head (producer) and tail (consumer) sit on their own cache lines, each side caching the other's index
+//so the shared line is only touched when the ring looks full/empty
+//shutdown: the producer calls close() after its last push; once the consumer sees closed() whatever
+//tryPop still returns is everything that was ever pushed
+template<class T>
+class SpscRing final {
+    public:
+        explicit SpscRing(std::size_t minCapacity) : capacity(std::bit_ceil(std::max<std::size_t>(minCapacity, 2))), mask(capacity - 1), buffer(new T[capacity]) {}
+
+        //producer only; false if full
+        bool tryPush(T const& value) {
+            auto h = head.load(std::memory_order_relaxed);
+            if (h - tailCache == capacity) {
+                tailCache = tail.load(std::memory_order_acquire);
+                if (h - tailCache == capacity) return false;
+            }
+            buffer[h & mask] = value;
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        //producer only; pushes the longest prefix of values that fits, publishing it with one store to head; returns its length
+        std::size_t tryPush(std::span<const T> values) {
+            auto h = head.load(std::memory_order_relaxed);
+            if (capacity - (h - tailCache) < values.size()) tailCache = tail.load(std::memory_order_acquire);
+            auto n = std::min(capacity - (h - tailCache), values.size());
+            for (std::size_t i = 0; i < n; i++) buffer[(h + i) & mask] = values[i];
+            if (n != 0) head.store(h + n, std::memory_order_release);
+            return n;
+        }
+
+        //consumer only; the next element without removing it, nullptr if empty
+        T const* peek() {
+            auto t = tail.load(std::memory_order_relaxed);
+            if (t == headCache) {
+                headCache = head.load(std::memory_order_acquire);
+                if (t == headCache) return nullptr;
+            }
+            return &buffer[t & mask];
+        }
+
+        //consumer only; false if empty
+        bool tryPop(T& out) {
+            auto t = tail.load(std::memory_order_relaxed);
+            if (t == headCache) {
+                headCache = head.load(std::memory_order_acquire);
+                if (t == headCache) return false;
+            }
+            out = buffer[t & mask];
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        void close() {
+            closedFlag.store(true, std::memory_order_release);
+        }
+
+        bool closed() const {
+            return closedFlag.load(std::memory_order_acquire);
+        }
+
+        //approximate when called while the other side is running
+        std::size_t size() const {
+            return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+        }
+
+        std::size_t getCapacity() const {
+            return capacity;
+        }
+    private:
+        const std::size_t capacity;
+        const std::size_t mask;
+        std::unique_ptr<T[]> buffer;
+        std::atomic<bool> closedFlag = false;
+
+        alignas(CACHE_LINE) std::atomic<std::size_t> head = 0;
+        std::size_t tailCache = 0; //producer's last view of tail
+        alignas(CACHE_LINE) std::atomic<std::size_t> tail = 0;
+        std::size_t headCache = 0; //consumer's last view of head
+};
+
+//bounded multi-producer/single-consumer queue built from one SpscRing per producer (e.g. per book shard),
+//so producers never contend with each other; each producer pushes to and closes its own ring
+template<class T>
+class MultiSpscQueue final {
+    public:
+        MultiSpscQueue(std::size_t producers, std::size_t capacityEach) : watermarks(new Watermark[producers]) {
+            for (std::size_t i = 0; i < producers; i++) rings.push_back(std::make_unique<SpscRing<T>>(capacityEach));
+        }
+
+        SpscRing<T>& producer(std::size_t i) {
+            return *rings[i];
+        }
+
+        std::size_t producers() const {
+            return rings.size();
+        }
+
+        //polls the rings round-robin; false if all are empty
+        bool tryPop(T& out) {
+            for (std::size_t k = 0; k < rings.size(); k++) {
+                std::size_t i = next + k < rings.size() ? next + k : next + k - rings.size();
+                if (rings[i]->tryPop(out)) {
+                    next = i + 1 == rings.size() ? 0 : i + 1;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        //producer only; promises that everything this producer pushes from now on has a key >= mark
+        //lets tryPopOrdered get past the producer while it has nothing queued, so an idle producer doesn't hold up the merge
+        void setWatermark(std::size_t producer, uint64_t mark) {
+            watermarks[producer].mark.store(mark, std::memory_order_release);
+        }
+
+        //pops the smallest key(element) among the ring heads, ties going to the lower producer index
+        //it waits (returns false) while an open producer with nothing queued might still send something that sorts first (see setWatermark);
+        //if each producer pushes in key order the merged output is in key order and the same on every run
+        template<class Key>
+        bool tryPopOrdered(T& out, Key key) {
+            std::size_t best = rings.size();
+            idle.clear();
+            for (std::size_t i = 0; i < rings.size(); i++) {
+                auto& ring = rings[i];
+                auto mark = watermarks[i].mark.load(std::memory_order_acquire); //before peek, so the pushes it covers are visible
+                bool closed = ring->closed(); //likewise, so a closed ring that looks empty really is
+                auto head = ring->peek();
+                if (head == nullptr) {
+                    if (!closed) idle.push_back({i, mark});
+                    continue;
+                }
+                if (best == rings.size() || key(*head) < key(*rings[best]->peek())) best = i;
+            }
+            if (best == rings.size()) return false;
+            uint64_t k = key(*rings[best]->peek());
+            for (auto [i, mark] : idle) {
+                if (k > mark || (k == mark && i < best)) return false;
+            }
+            return rings[best]->tryPop(out);
+        }
+
+        //consumer only
+        bool empty() {
+            for (auto& ring : rings) {
+                if (ring->peek() != nullptr) return false;
+            }
+            return true;
+        }
+
+        //every producer has closed its ring
+        bool closed() const {
+            for (auto const& ring : rings) {
+                if (!ring->closed()) return false;
+            }
+            return true;
+        }
+    private:
+        struct alignas(CACHE_LINE) Watermark {
+            std::atomic<uint64_t> mark{0};
+        };
+
+        std::vector<std::unique_ptr<SpscRing<T>>> rings;
+        std::unique_ptr<Watermark[]> watermarks;
+        std::vector<std::pair<std::size_t, uint64_t>> idle; //tryPopOrdered scratch: open producers with nothing queued and their watermarks
+        std::size_t next = 0;
+};
+
+//lets producers wake a parked consumer; notify() is a fence and a load unless the consumer is actually asleep,
+//so producers can call it after every block they push (and must call it after closing)
+class WakeSignal final {
+    public:
+        void notify() {
+            std::atomic_thread_fence(std::memory_order_seq_cst); //pairs with the one in park(): either we see sleeping or it sees our push
+            if (sleeping.load(std::memory_order_relaxed)) {
+                epoch.fetch_add(1, std::memory_order_release);
+                epoch.notify_one();
+            }
+        }
+
+        //consumer only; sleeps unless ready() says there's work after announcing it's going to
+        template<class Ready>
+        void park(Ready ready) {
+            auto seen = epoch.load(std::memory_order_acquire);
+            sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!ready()) epoch.wait(seen, std::memory_order_acquire);
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+    private:
+        std::atomic<uint32_t> epoch{0};
+        std::atomic<bool> sleeping{false};
+};
+
+//what a producer does when its ring to the writer is full
+enum class OverflowPolicy {
+    BLOCK,       //wait for room; nothing is lost but the book thread stalls behind the writer
+    DROP_NEWEST, //discard the update that didn't fit
+    DROP_OLDEST, //hold updates back on the producer side, discarding the oldest held one when that backlog is full too
+    CONFLATE     //hold back only the latest update per symbol until there's room
+};
+
+inline std::string to_string(OverflowPolicy policy) {
+    switch (policy) {
+        case OverflowPolicy::BLOCK: return "block";
+        case OverflowPolicy::DROP_NEWEST: return "drop_newest";
+        case OverflowPolicy::DROP_OLDEST: return "drop_oldest";
+        case OverflowPolicy::CONFLATE: return "conflate";
+    }
+    return "";
+}
+
+//false (and out unchanged) for an unknown name
+inline bool parseOverflowPolicy(std::string const& name, OverflowPolicy& out) {
+    for (auto policy : {OverflowPolicy::BLOCK, OverflowPolicy::DROP_NEWEST, OverflowPolicy::DROP_OLDEST, OverflowPolicy::CONFLATE}) {
+        if (to_string(policy) == name) {
+            out = policy;
+            return true;
+        }
+    }
+    return false;
+}
+
+//shared by all producers of a queue and read by anyone, e.g. at shutdown
+struct OverflowStats {
+    std::atomic<uint64_t> dropped{0};   //updates thrown away: the newest (DROP_NEWEST) or the oldest held back (DROP_OLDEST)
+    std::atomic<uint64_t> conflated{0}; //held back updates replaced by a newer one for the same symbol (CONFLATE)
+    std::atomic<uint64_t> fullWaits{0}; //pushes that found the ring full
+    std::atomic<uint64_t> highWater{0}; //most elements seen queued in one ring; sampled, plus exact whenever a ring fills
+};
+
+//producer end of one ring to the writer, applying an OverflowPolicy when the ring is full
+//updates held back by DROP_OLDEST/CONFLATE go out ahead of newer ones as soon as there's room again, so per symbol
+//the writer still sees updates in order; flush() waits until everything held is delivered
+//T needs a symbolId and an exchTime (CONFLATE keeps the latest per symbol, oldest exchTime going out first)
+template<class T>
+class Outbox final {
+    public:
+        //wake is notified whenever the ring is found full, so a parked consumer can't leave the producer waiting for room
+        Outbox(SpscRing<T>& ring, OverflowPolicy policy, OverflowStats& stats, std::size_t backlogSize = 1024, WakeSignal* wake = nullptr) :
+            ring(ring), policy(policy), stats(stats), wake(wake), backlog(policy == OverflowPolicy::DROP_OLDEST ? std::max<std::size_t>(backlogSize, 1) : 0) {}
+
+        void push(T const& value) {
+            switch (policy) {
+                case OverflowPolicy::BLOCK:
+                    if (!tryPush(value)) {
+                        do std::this_thread::yield(); while (!ring.tryPush(value));
+                    }
+                    break;
+                case OverflowPolicy::DROP_NEWEST:
+                    if (!tryPush(value)) stats.dropped.fetch_add(1, std::memory_order_relaxed);
+                    break;
+                case OverflowPolicy::DROP_OLDEST:
+                    if (pushBacklog() && tryPush(value)) break;
+                    if (!backlog.add(value)) stats.dropped.fetch_add(1, std::memory_order_relaxed); //RingBuffer overwrote its oldest
+                    break;
+                case OverflowPolicy::CONFLATE:
+                    if (pushHeld() && tryPush(value)) break;
+                    hold(value);
+                    break;
+            }
+        }
+
+        //a block of updates, e.g. everything a book thread collected since its last flush: what fits goes into the ring with one
+        //publish of its head, the rest is handled by the policy as if pushed one at a time
+        void push(std::span<const T> values) {
+            switch (policy) {
+                case OverflowPolicy::BLOCK:
+                    for (auto n = tryPush(values); n < values.size(); n += ring.tryPush(values.subspan(n))) std::this_thread::yield();
+                    break;
+                case OverflowPolicy::DROP_NEWEST:
+                    stats.dropped.fetch_add(values.size() - tryPush(values), std::memory_order_relaxed);
+                    break;
+                case OverflowPolicy::DROP_OLDEST:
+                    for (auto const& value : values.subspan(pushBacklog() ? tryPush(values) : 0)) {
+                        if (!backlog.add(value)) stats.dropped.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    break;
+                case OverflowPolicy::CONFLATE:
+                    for (auto const& value : values.subspan(pushHeld() ? tryPush(values) : 0)) hold(value);
+                    break;
+            }
+        }
+
+        //waits until everything held back is in the ring; call before closing it
+        void flush() {
+            while (!tryFlush()) std::this_thread::yield();
+        }
+
+        //moves as much of what's held back into the ring as fits; true once nothing is held
+        bool tryFlush() {
+            return pushBacklog() && pushHeld();
+        }
+
+        //updates currently held back on the producer side
+        std::size_t held() {
+            return backlog.count() + heldOrder.size();
+        }
+    private:
+        static const uint64_t HIGH_WATER_SAMPLE = 64; //pushes between occupancy samples; reading it touches the consumer's cache line
+
+        SpscRing<T>& ring;
+        OverflowPolicy policy;
+        OverflowStats& stats;
+        WakeSignal* wake;
+        uint64_t pushes = 0;
+
+        RingBuffer<T> backlog; //DROP_OLDEST
+        std::vector<T> latest; //CONFLATE: indexed by symbol id, valid where isHeld is set
+        std::vector<char> isHeld;
+        std::vector<symbol_id> heldOrder;
+
+        bool tryPush(T const& value) {
+            if (!ring.tryPush(value)) {
+                stats.fullWaits.fetch_add(1, std::memory_order_relaxed);
+                if (wake) wake->notify();
+                raiseHighWater(ring.getCapacity());
+                return false;
+            }
+            if (++pushes % HIGH_WATER_SAMPLE == 0) raiseHighWater(ring.size());
+            return true;
+        }
+
+        //the longest prefix of values that fits; every value left over counts as a push that found the ring full
+        std::size_t tryPush(std::span<const T> values) {
+            auto n = ring.tryPush(values);
+            if (n < values.size()) {
+                stats.fullWaits.fetch_add(values.size() - n, std::memory_order_relaxed);
+                if (wake) wake->notify();
+                raiseHighWater(ring.getCapacity());
+            }
+            if ((pushes + n) / HIGH_WATER_SAMPLE != pushes / HIGH_WATER_SAMPLE) raiseHighWater(ring.size());
+            pushes += n;
+            return n;
+        }
+
+        void raiseHighWater(uint64_t queued) {
+            auto seen = stats.highWater.load(std::memory_order_relaxed);
+            while (queued > seen && !stats.highWater.compare_exchange_weak(seen, queued, std::memory_order_relaxed)) {}
+        }
+
+        //true once the backlog is empty
+        bool pushBacklog() {
+            while (backlog.count() > 0) {
+                if (!tryPush(backlog.front())) return false;
+                backlog.get();
+            }
+            return true;
+        }
+
+        void hold(T const& value) {
+            auto id = value.symbolId;
+            if (id >= latest.size()) {
+                latest.resize(id + 1);
+                isHeld.resize(id + 1);
+            }
+            if (isHeld[id]) {
+                stats.conflated.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                isHeld[id] = true;
+                heldOrder.push_back(id);
+            }
+            latest[id] = value;
+        }
+
+        //held symbols go out oldest exchTime first; true once none are held
+        bool pushHeld() {
+            if (heldOrder.empty()) return true;
+            std::stable_sort(heldOrder.begin(), heldOrder.end(), [&](symbol_id a, symbol_id b) { return latest[a].exchTime < latest[b].exchTime; });
+            std::size_t sent = 0;
+            while (sent < heldOrder.size() && tryPush(latest[heldOrder[sent]])) isHeld[heldOrder[sent++]] = false;
+            heldOrder.erase(heldOrder.begin(), heldOrder.begin() + sent);
+            return heldOrder.empty();
+        }
+};
+
+using L1Outbox = Outbox<L1Datum>;
+
+//how a consumer waits when its queue is empty
+enum class WaitPolicy {
+    SPIN,       //cpuRelax() in a loop: lowest wake-up latency, burns the core
+    SPIN_YIELD, //spin a while, then yield the core to other runnable threads between polls
+    SPIN_PARK   //spin a while, then sleep in the kernel (atomic wait) until a producer calls WakeSignal::notify()
+};
+
+inline std::string to_string(WaitPolicy policy) {
+    switch (policy) {
+        case WaitPolicy::SPIN: return "spin";
+        case WaitPolicy::SPIN_YIELD: return "spin_yield";
+        case WaitPolicy::SPIN_PARK: return "spin_park";
+    }
+    return "";
+}
+
+//false (and out unchanged) for an unknown name
+inline bool parseWaitPolicy(std::string const& name, WaitPolicy& out) {
+    for (auto policy : {WaitPolicy::SPIN, WaitPolicy::SPIN_YIELD, WaitPolicy::SPIN_PARK}) {
+        if (to_string(policy) == name) {
+            out = policy;
+            return true;
+        }
+    }
+    return false;
+}
+
+//consumer side of a WaitPolicy: call idle() each time the queue comes up empty and reset() after getting something
+class Waiter final {
+    public:
+        Waiter(WaitPolicy policy, WakeSignal& signal, unsigned spinLimit = 100) : policy(policy), signal(signal), spinLimit(spinLimit) {}
+
+        //ready() rechecks for work (or shutdown) before parking
+        template<class Ready>
+        void idle(Ready ready) {
+            if (policy == WaitPolicy::SPIN || spins < spinLimit) {
+                spins++;
+                cpuRelax();
+            } else if (policy == WaitPolicy::SPIN_YIELD) {
+                std::this_thread::yield();
+            } else {
+                signal.park(ready);
+            }
+        }
+
+        void reset() {
+            spins = 0;
+        }
+    private:
+        WaitPolicy policy;
+        WakeSignal& signal;
+        unsigned spinLimit;
+        unsigned spins = 0;
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+
+//runtime settings read from a key=value file; '#' starts a comment
+//a missing file or key just means the default is used
+class Config final {
+    public:
+        Config() = default;
+
+        explicit Config(std::string const& path) {
+            std::ifstream in(path);
+            std::string line;
+            while (std::getline(in, line)) {
+                line = line.substr(0, line.find('#'));
+                auto eq = line.find('=');
+                if (eq == std::string::npos) continue;
+                auto key = trim(line.substr(0, eq));
+                if (!key.empty()) values[key] = trim(line.substr(eq + 1));
+            }
+        }
+
+        std::string get(std::string const& key, std::string const& def) const {
+            auto it = values.find(key);
+            return it == values.end() ? def : it->second;
+        }
+
+        long long getInt(std::string const& key, long long def) const {
+            auto it = values.find(key);
+            if (it == values.end()) return def;
+            try {
+                return std::stoll(it->second);
+            } catch (std::exception const&) {
+                std::cerr << "Config: " << key << " is not a number, using " << def << "\n";
+                return def;
+            }
+        }
+    private:
+        std::unordered_map<std::string, std::string> values;
+
+        static std::string trim(std::string const& s) {
+            auto begin = s.find_first_not_of(" \t\r");
+            if (begin == std::string::npos) return "";
+            return s.substr(begin, s.find_last_not_of(" \t\r") - begin + 1);
+        }
+};
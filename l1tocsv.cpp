@@ -0,0 +1,41 @@
+#include "lib.cpp"
+#include "output.cpp"
+
+//converts an l1.bin written with l1.format=binary into the l1.out CSV main writes by default
+//usage: l1tocsv [l1.bin [l1.out]] [--fixed-point]
+
+int main(int argc, char** argv) {
+    std::vector<std::string> paths;
+    bool fixedPoint = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--fixed-point") fixedPoint = true;
+        else paths.push_back(arg);
+    }
+    if (paths.size() > 2) {
+        std::cerr << "usage: " << argv[0] << " [l1.bin [l1.out]] [--fixed-point]\n";
+        return 2;
+    }
+    std::string in = paths.size() > 0 ? paths[0] : "l1.bin";
+    std::string out = paths.size() > 1 ? paths[1] : "l1.out";
+
+    try {
+        BinaryRecordReader<L1Datum> reader(in, "L1D1");
+        //decimals are printed with this build's PRICE_FACTOR, so a file from a build with another one can only be copied as raw ticks
+        if (fixedPoint && reader.getHeader().priceFactor != PRICE_FACTOR) {
+            std::cerr << in << " was written with price factor " << reader.getHeader().priceFactor << ", not " << PRICE_FACTOR << "\n";
+            return 1;
+        }
+        L1CsvWriter writer(out, reader.getSymbols(), fixedPoint);
+        L1Datum L1d;
+        std::size_t records = 0;
+        while (reader.read(L1d)) {
+            writer.write(L1d);
+            records++;
+        }
+        std::cout << records << " records written to " << out << "\n";
+    } catch (std::exception const& ex) {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
+}
@@ -1,10 +1,23 @@
+#pragma once
 #include <iostream>
+#include <array>
 #include <list>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <unordered_map>
 #include <ext/pb_ds/assoc_container.hpp>
 #include <map>
+#include <deque>
+#include <optional>
+#include <span>
+#include <vector>
+#include <ranges>
+#include <iterator>
+#include <type_traits>
+#include <concepts>
+#include <cstring>
+#include <string_view>
 //#include <thread>
 #include <mutex>
 #include <condition_variable>
@@ -35,12 +48,14 @@ using timestamp = uint64_t;
 struct Order {
     int id;
     timestamp exchTime;
-    int price; //price * 1000, always int
+    int price; //price * PRICE_FACTOR, always int
     int qty;
     Side side;
     std::string symbol;
 };
-using Orders = std::list<Order>;
+template<class Alloc = std::allocator<Order>>
+using BasicOrders = std::list<Order, Alloc>;
+using Orders = BasicOrders<>;
 using OrderRef = Orders::iterator;
 
 bool operator==(const Order& o1, const Order& o2) {
@@ -59,15 +74,18 @@ bool operator!=(const Order& o1, const Order& o2) {
     return !(o1 == o2);
 }
 
-struct PriceLevel {
+template<class OrdersT>
+struct BasicPriceLevel {
     int price;
     int volume = 0;
     int count = 0; //# of orders
-    Orders orders;
+    OrdersT orders;
     //side?
 };
+using PriceLevel = BasicPriceLevel<Orders>;
 
-bool operator==(const PriceLevel& pl1, const PriceLevel& pl2) {
+template<class OrdersT>
+bool operator==(const BasicPriceLevel<OrdersT>& pl1, const BasicPriceLevel<OrdersT>& pl2) {
     if (pl1.price != pl2.price || pl1.volume != pl2.volume || pl1.count != pl2.count) return false;
     if (pl1.orders.size() != pl2.orders.size()) return false;
     auto it1 = pl1.orders.begin();
@@ -82,7 +100,8 @@ bool operator==(const PriceLevel& pl1, const PriceLevel& pl2) {
     return true;
 }
 
-bool operator!=(const PriceLevel& pl1, const PriceLevel& pl2) {
+template<class OrdersT>
+bool operator!=(const BasicPriceLevel<OrdersT>& pl1, const BasicPriceLevel<OrdersT>& pl2) {
     return !(pl1 == pl2);
 }
 
@@ -97,7 +116,8 @@ std::ostream& operator<<(std::ostream& stream, const Order& o) {
     return stream;
 }
 
-std::string to_string(const Orders& orders) {
+template<class Alloc>
+std::string to_string(const BasicOrders<Alloc>& orders) {
     std::ostringstream os;
     if (orders.empty()) {
         os << "[]";
@@ -110,18 +130,21 @@ std::string to_string(const Orders& orders) {
 }
 
 
-std::ostream& operator<<(std::ostream& stream, const Orders& orders) {
+template<class Alloc>
+std::ostream& operator<<(std::ostream& stream, const BasicOrders<Alloc>& orders) {
     stream << to_string(orders);
     return stream;
 }
 
-std::string to_string(const PriceLevel pl) {
+template<class OrdersT>
+std::string to_string(const BasicPriceLevel<OrdersT>& pl) {
     std::ostringstream os;
     os << "{price:" << (double) pl.price / PRICE_FACTOR << ",volume:" << pl.volume << ",count:" << pl.count << ",orders:" << pl.orders << "}";
     return os.str();
 }
 
-std::ostream& operator<<(std::ostream& stream, const PriceLevel pl) {
+template<class OrdersT>
+std::ostream& operator<<(std::ostream& stream, const BasicPriceLevel<OrdersT>& pl) {
     stream << to_string(pl);
     return stream;
 }
@@ -135,16 +158,201 @@ struct sideBookComp {
     bool do_greater;
 };
 
+//side books share one interface so Instrument can be built on either:
+//getLevel (creates if missing), findLevel (nullptr if missing), eraseLevel, size, levels (best price first)
+template<class Level = PriceLevel>
 class sideBook final {
     //not going to make these private; we will be returning references to them anyways (only for internal instrument use)
     public:
         Side side;
-        std::map<int, PriceLevel, sideBookComp<int>> priceLevels;
+        std::map<int, Level, sideBookComp<int>> priceLevels;
 
         sideBook(Side s) : side(s), priceLevels(side) {}
+
+        Level* getLevel(int price) {
+            return &priceLevels[price];
+        }
+
+        Level* findLevel(int price) noexcept {
+            auto it = priceLevels.find(price);
+            return it == priceLevels.end() ? nullptr : &it->second;
+        }
+
+        void eraseLevel(int price) {
+            priceLevels.erase(price);
+        }
+
+        std::size_t size() const noexcept {
+            return priceLevels.size();
+        }
+
+        auto levels() {
+            return std::views::values(priceLevels);
+        }
+};
+
+//sorted vector with the best price at the back: changes at the touch are tail inserts/erases
+//and walking the whole book is a scan over contiguous memory
+//meant for symbols with modest depth, since inserting deep in the book shifts every better level
+template<class Level = PriceLevel>
+class vectorSideBook final {
+    //levels move around inside the vector, so this keeps the order iterators in ordersById valid
+    static_assert(std::is_nothrow_move_constructible_v<Level>);
+
+    public:
+        Side side;
+        std::vector<Level> priceLevels;
+
+        vectorSideBook(Side s) : side(s) {}
+
+        Level* getLevel(int price) {
+            auto it = afterPrice(price);
+            if (it != priceLevels.begin() && std::prev(it)->price == price) return &*std::prev(it);
+            return &*priceLevels.insert(it, Level{price, 0, 0, {}});
+        }
+
+        Level* findLevel(int price) noexcept {
+            auto it = afterPrice(price);
+            if (it != priceLevels.begin() && std::prev(it)->price == price) return &*std::prev(it);
+            return nullptr;
+        }
+
+        void eraseLevel(int price) {
+            auto it = afterPrice(price);
+            if (it != priceLevels.begin() && std::prev(it)->price == price) priceLevels.erase(std::prev(it));
+        }
+
+        std::size_t size() const noexcept {
+            return priceLevels.size();
+        }
+
+        auto levels() {
+            return std::views::reverse(priceLevels);
+        }
+    private:
+        //first level strictly better than price; scans from the back since most activity is near the touch
+        typename std::vector<Level>::iterator afterPrice(int price) noexcept {
+            sideBookComp<int> better(side);
+            auto it = priceLevels.end();
+            while (it != priceLevels.begin() && better(std::prev(it)->price, price)) it--;
+            return it;
+        }
+};
+
+//price/volume/count of one level without its orders
+struct LevelData {
+    int price;
+    int volume;
+    int count;
+};
+
+using symbol_id = uint32_t;
+
+//interns symbol names as dense ids, so per-update data can carry an id instead of a string
+//and the name is only looked up when writing output
+//intern/find belong to one thread (the parser); name() works from any thread for an id that thread handed over
+//(e.g. in an L1Datum through a queue), since stored names never move
+class SymbolTable final {
+    public:
+        symbol_id intern(std::string const& name) {
+            auto it = ids.find(name);
+            if (it != ids.end()) return it->second;
+            symbol_id id = count.load(std::memory_order_relaxed);
+            if (id == CHUNK_SIZE * MAX_CHUNKS) throw std::length_error{"Too many symbols"};
+            auto& chunk = chunks[id / CHUNK_SIZE];
+            if (!chunk) chunk = std::make_unique<std::string[]>(CHUNK_SIZE);
+            chunk[id % CHUNK_SIZE] = name;
+            count.store(id + 1, std::memory_order_release);
+            ids[name] = id;
+            return id;
+        }
+
+        std::optional<symbol_id> find(std::string const& name) const {
+            auto it = ids.find(name);
+            if (it == ids.end()) return std::nullopt;
+            return it->second;
+        }
+
+        std::string const& name(symbol_id id) const {
+            return chunks[id / CHUNK_SIZE][id % CHUNK_SIZE];
+        }
+
+        std::size_t size() const {
+            return count.load(std::memory_order_acquire);
+        }
+    private:
+        static const std::size_t CHUNK_SIZE = 1024;
+        static const std::size_t MAX_CHUNKS = 4096;
+
+        std::array<std::unique_ptr<std::string[]>, MAX_CHUNKS> chunks; //fixed, so lookups never race with growth
+        std::atomic<symbol_id> count{0};
+        std::unordered_map<std::string, symbol_id> ids;
+};
+
+//a symbol of up to 8 bytes packed into an integer, so it can be looked up straight from the raw message bytes
+//0 means the name didn't fit (or was empty); names are assumed not to contain '\0'
+using symbol_key = uint64_t;
+
+inline symbol_key packSymbol(std::string_view name) {
+    if (name.empty() || name.size() > sizeof(symbol_key)) return 0;
+    symbol_key key = 0;
+    std::memcpy(&key, name.data(), name.size());
+    return key;
+}
+
+//symbol_key -> symbol_id, open addressing with linear probing in a flat power-of-two table
+//no strings or string hashing on lookups; meant to sit in front of SymbolTable on the parser thread
+class SymbolKeyIndex final {
+    public:
+        static constexpr symbol_id NOT_FOUND = UINT32_MAX;
+
+        symbol_id find(symbol_key key) const {
+            if (key == 0) return NOT_FOUND;
+            for (auto i = slotOf(key);; i = (i + 1) & mask) {
+                if (slots[i].key == key) return slots[i].id;
+                if (slots[i].key == 0) return NOT_FOUND;
+            }
+        }
+
+        //key must not be 0
+        void insert(symbol_key key, symbol_id id) {
+            if ((count + 1) * 2 > slots.size()) rehash(slots.size() * 2);
+            auto i = slotOf(key);
+            while (slots[i].key != 0 && slots[i].key != key) i = (i + 1) & mask;
+            if (slots[i].key == 0) count++;
+            slots[i] = {key, id};
+        }
+
+        std::size_t size() const {
+            return count;
+        }
+    private:
+        struct Slot {
+            symbol_key key;
+            symbol_id id;
+        };
+
+        std::vector<Slot> slots = std::vector<Slot>(64);
+        std::size_t mask = 63;
+        std::size_t count = 0;
+
+        std::size_t slotOf(symbol_key key) const {
+            return (key * 0x9E3779B97F4A7C15ull) >> 32 & mask; //Fibonacci hashing; the high bits mix all 8 bytes
+        }
+
+        void rehash(std::size_t capacity) {
+            auto old = std::move(slots);
+            slots.assign(capacity, Slot{0, 0});
+            mask = capacity - 1;
+            count = 0;
+            for (auto const& slot : old) {
+                if (slot.key != 0) insert(slot.key, slot.id);
+            }
+        }
 };
 
 //a single snapshot of L1 data
+//kept trivially copyable so it can be memcpy'd into queues/shared memory; resolve symbolId through a SymbolTable
 struct L1Datum {
     timestamp exchTime;
     //timestamp recvTime //add?
@@ -152,8 +360,11 @@ struct L1Datum {
     int volume[2];
     int count[2];
 
-    std::string symbol;
+    symbol_id symbolId;
+    uint32_t reserved = 0; //what would be padding, zeroed so l1.bin records are the same bytes on every run
 };
+static_assert(std::is_trivially_copyable_v<L1Datum>);
+static_assert(std::has_unique_object_representations_v<L1Datum> && sizeof(L1Datum) == 40);
 
 template<class T>
 class RingBuffer {
@@ -191,6 +402,11 @@ class RingBuffer {
             return toReturn;
         }
 
+        //oldest element; only valid when count() > 0
+        T const& front() const {
+            return buffer[readPos];
+        }
+
         size_t count() {
             return numFilled;
         }
@@ -198,32 +414,103 @@ class RingBuffer {
         size_t size;
         std::vector<T> buffer;
 
-        size_t readPos, writePos = 0;
+        size_t readPos = 0, writePos = 0;
         size_t numFilled = 0;
 
         bool LOG_WHEN_INVALID = false; //can turn off for performance reasons/on for debug?
 };
 
-class Instrument final {
+//a BookPolicy picks the containers an Instrument is built from:
+//Allocator/OrderContainer hold each level's queue, LevelContainer is the side book (see sideBook),
+//OrderIndex maps order ids to positions in those queues (so order container iterators must survive moves)
+struct MapBookPolicy {
+    using Allocator = std::allocator<Order>;
+    using OrderContainer = BasicOrders<Allocator>;
+    using Level = BasicPriceLevel<OrderContainer>;
+    using LevelContainer = sideBook<Level>;
+    using OrderIndex = std::unordered_map<int, OrderContainer::iterator>;
+};
+
+struct VectorBookPolicy {
+    using Allocator = std::allocator<Order>;
+    using OrderContainer = BasicOrders<Allocator>;
+    using Level = BasicPriceLevel<OrderContainer>;
+    using LevelContainer = vectorSideBook<Level>;
+    using OrderIndex = std::unordered_map<int, OrderContainer::iterator>;
+};
+
+enum LevelAction : uint8_t {
+    LEVEL_ADD = 0,
+    LEVEL_UPDATE = 1,
+    LEVEL_DELETE = 2
+};
+
+//one change to one price level (market-by-price); volume/count are the level's new totals (0 on delete)
+//written to l2.bin as is, so what would be padding is an explicit zeroed field and two runs give the same bytes
+struct LevelDelta {
+    timestamp exchTime;
+    symbol_id symbolId;
+    Side side;
+    LevelAction action;
+    uint8_t reserved[3] = {};
+    int price;
+    int volume;
+    int count;
+};
+static_assert(std::is_trivially_copyable_v<LevelDelta>);
+static_assert(std::has_unique_object_representations_v<LevelDelta> && sizeof(LevelDelta) == 32);
+
+enum L3Action : uint8_t {
+    ORDER_ADD = 0,
+    ORDER_CANCEL = 1,
+    ORDER_EXECUTE = 2
+};
+
+//one order-level event with fields derived from the book that the raw feed doesn't carry
+struct L3Event {
+    timestamp exchTime;
+    symbol_id symbolId;
+    int orderId;
+    Side side;
+    L3Action action;
+    bool atTouch; //order's level was the best on its side (after an add, before a cancel/execute)
+    int price; //the level the order sits on
+    int qty; //added, cancelled or executed
+    int remainingQty; //left on the order afterwards
+    int queuePosition; //orders ahead of it in the level when added; -1 for cancels/executions
+};
+static_assert(std::is_trivially_copyable_v<L3Event>);
+
+//an L1 sink is anything callable with a const L1Datum&; Instrument holds it by value,
+//so a sink type known at compile time gets inlined into the book update path
+//FunctionSink is the runtime function pointer version (what setCallback sets)
+//a sink that is also callable with a const LevelDelta& gets the L2 delta feed once enableDeltas is called,
+//and one callable with a const L3Event& gets order events once enableL3 is called; other sinks compile both out
+struct FunctionSink {
+    void(*callback)(L1Datum) = [](L1Datum) {}; //empty fn
+
+    void operator()(L1Datum const& L1d) const {
+        callback(L1d);
+    }
+};
+
+template<class BookPolicy = MapBookPolicy, class Sink = FunctionSink>
+class BasicInstrument final {
+    using Level = typename BookPolicy::Level;
+    using OrderIt = typename BookPolicy::OrderContainer::iterator;
+    using SideBook = typename BookPolicy::LevelContainer;
+
     public:
-        Instrument() = default;
+        BasicInstrument() = default;
 
-        explicit Instrument(std::string const& sym) {
+        explicit BasicInstrument(std::string const& sym, symbol_id id = 0) {
             symbol = sym;
-            L1 = {
-                0,
-                UNDEF_PRICE,
-                UNDEF_PRICE,
-                0,
-                0,
-                0,
-                0,
-                symbol
-            };
+            symbolId = id;
+            L1.symbolId = symbolId;
         }
 
         //if we want to specify an initialization time, I guess?
-        /*explicit Instrument(std::string const& sym, timestamp startTime) {
+        /*explicit BasicInstrument(std::string const& sym, timestamp startTime) {
             symbol = sym;
             L1 = {
                 startTime,
@@ -233,18 +520,24 @@ class Instrument final {
                 0,
                 0,
                 0,
-                symbol
+                symbolId
             };
         }*/
 
         void addOrder(Order const& order) {
             bool L1Update = L1.price[order.side] == UNDEF_PRICE || order.price == L1.price[order.side] || sideBookComp<int>(order.side)(order.price, L1.price[order.side]);
 
+            expireEmptyLevels(order.side, order.exchTime);
+            std::size_t levelsBefore = bookSides[order.side].size();
             auto pl = getLevelPointer(order.price, order.side);
+            if (bookSides[order.side].size() != levelsBefore) levelStats.created++;
+            else if (pl->count == 0) reuseEmptyLevel(order.price, order.side);
             pl->price = order.price;
             ordersById[order.id] = pl->orders.insert(pl->orders.end(), order);
             pl->volume += order.qty;
             pl->count++;
+            emitDelta(pl->count == 1 ? LEVEL_ADD : LEVEL_UPDATE, order.side, order.price, pl->volume, pl->count, order.exchTime);
+            emitL3(ORDER_ADD, order, order.qty, order.qty, pl->count - 1, order.exchTime);
             
             if (L1Update) {
                 //std::cout << "add order L1 chg\n";
@@ -252,26 +545,9 @@ class Instrument final {
             }
         }
 
-        void removeOrder(Orders::iterator it, timestamp time) { //honestly can be private
-            auto const& order = *it;
-            int orderId = order.id;
-            bool L1Update = L1.price[order.side] == UNDEF_PRICE || order.price == L1.price[order.side] || sideBookComp<int>(order.side)(order.price, L1.price[order.side]);
-            auto pl = getLevelPointer(order.price, order.side);
-
-            pl->volume -= order.qty;
-            pl->count--;
-            if (pl->count == 0) {
-                bookSides[order.side].priceLevels.erase(order.price); //maybe not ideal performance-wise; change getLevelPointer to iterator?
-            } else {
-                pl->orders.erase(it);
-            }
-
-            ordersById.erase(orderId);
-            //if update occurs at or better than cur best
-            if (L1Update) {
-                //std::cout << "remove order L1 chg\n";
-                callbackL1(time);
-            }
+        void removeOrder(OrderIt it, timestamp time) { //honestly can be private
+            emitL3(ORDER_CANCEL, *it, it->qty, 0, -1, time);
+            eraseOrder(it, time);
         }
         
         void removeOrder(int id, timestamp time) {
@@ -280,15 +556,19 @@ class Instrument final {
         }
 
         //one issue here: when a trade is executed at the bbo the L1 callback will be triggered twice (when in reality it should only trigger after the trade finishes)
+        //(callbackL1 now drops updates that leave the touch unchanged, but each step of a sweep is still its own update)
         //although this kind of generally ties into issues that arise from the fact that we're not using packets (similar to the "aggressive orders that get immediately filled" but show up in our book history)
-        void executeOrder(Orders::iterator it, int execQty, timestamp time) {
+        void executeOrder(OrderIt it, int execQty, timestamp time) {
             auto const& order = *it;
             if (order.qty < execQty) throw std::invalid_argument{"execQty " + std::to_string(execQty) + " greater than order qty " + std::to_string(order.qty)};
-            if (order.qty == execQty) removeOrder(it, time);
+            emitL3(ORDER_EXECUTE, order, execQty, order.qty - execQty, -1, time);
+            if (order.qty == execQty) eraseOrder(it, time);
             else {
                 bool L1Update = L1.price[order.side] == UNDEF_PRICE || order.price == L1.price[order.side] || sideBookComp<int>(order.side)(order.price, L1.price[order.side]);
                 it->qty -= execQty;
-                getLevelPointer(order.price, order.side)->volume -= execQty;
+                auto pl = getLevelPointer(order.price, order.side);
+                pl->volume -= execQty;
+                emitDelta(LEVEL_UPDATE, order.side, order.price, pl->volume, pl->count, time);
                 //if update occurs at or better than cur best
                 if (L1Update) {
                     //std::cout << "exec order L1 chg\n";
@@ -306,91 +586,324 @@ class Instrument final {
             return *getOrderPtr(id);
         }
 
-        const PriceLevel& getLevelByIndex(std::size_t index, Side side) {
-            if (bookSides[side].priceLevels.size() > index) {
-                auto it = bookSides[side].priceLevels.begin();
-                if (index != 0) std::advance(it, index); //performance optimization?
-                return it->second;
-            }
-            throw std::invalid_argument{"No " + to_string(side) + " level at index " + std::to_string(index)};
+        const Level& getLevelByIndex(std::size_t index, Side side) {
+            auto pl = findLevelByIndex(index, side);
+            if (pl == nullptr) throw std::invalid_argument{"No " + to_string(side) + " level at index " + std::to_string(index)};
+            return *pl;
         }
 
         //performance friendly
         const std::tuple<int, int, int> getLevelDataByIndex(std::size_t index, Side side) {
-            if (bookSides[side].priceLevels.size() > index) {
-                auto it = bookSides[side].priceLevels.begin();
-                if (index != 0) std::advance(it, index); //performance optimization?
-                return {it->second.price, it->second.volume, it->second.count};
+            auto const& pl = getLevelByIndex(index, side);
+            return {pl.price, pl.volume, pl.count};
+        }
+
+        const Level& getLevelByPrice(int price, Side side) {
+            auto pl = findLevelByPrice(price, side);
+            if (pl == nullptr) throw std::invalid_argument{"No " + to_string(side) + " level at " + std::to_string((double) price / PRICE_FACTOR)};
+            return *pl;
+        }
+
+        const std::tuple<int, int, int> getLevelDataByPrice(int price, Side side) {
+            auto const& pl = getLevelByPrice(price, side);
+            return {pl.price, pl.volume, pl.count};
+        }
+
+        //non-throwing versions of the above: a missing order/level is nullptr or an empty optional
+        //these are what the book itself uses, since an empty side is an ordinary case and not worth an unwind
+        const Order* findOrderById(int id) noexcept {
+            auto it = ordersById.find(id);
+            return it == ordersById.end() ? nullptr : &*it->second;
+        }
+
+        const Level* findLevelByIndex(std::size_t index, Side side) noexcept {
+            if (bookSides[side].size() - emptiedLevels[side].size() <= index) return nullptr;
+            auto levels = activeLevels(side);
+            auto it = levels.begin();
+            if (index != 0) std::advance(it, index); //performance optimization?
+            return &*it;
+        }
+
+        const Level* findLevelByPrice(int price, Side side) noexcept {
+            auto pl = bookSides[side].findLevel(price);
+            return pl != nullptr && pl->count != 0 ? pl : nullptr;
+        }
+
+        std::optional<LevelData> findLevelDataByIndex(std::size_t index, Side side) noexcept {
+            auto pl = findLevelByIndex(index, side);
+            if (pl == nullptr) return std::nullopt;
+            return LevelData{pl->price, pl->volume, pl->count};
+        }
+
+        std::optional<LevelData> findLevelDataByPrice(int price, Side side) noexcept {
+            auto pl = findLevelByPrice(price, side);
+            if (pl == nullptr) return std::nullopt;
+            return LevelData{pl->price, pl->volume, pl->count};
+        }
+
+        //fills out with the best out.size() levels of a side in one pass; returns how many were written
+        std::size_t snapshotDepth(Side side, std::span<LevelData> out) noexcept {
+            std::size_t n = 0;
+            for (auto const& pl : activeLevels(side)) {
+                if (n == out.size()) break;
+                out[n++] = {pl.price, pl.volume, pl.count};
             }
-            throw std::invalid_argument{"No " + to_string(side) + " level at index " + std::to_string(index)};
+            return n;
         }
 
-        const PriceLevel& getLevelByPrice(int price, Side side) {
-            auto it = bookSides[side].priceLevels.find(price);
-            if (it == bookSides[side].priceLevels.end()) throw std::invalid_argument{"No " + to_string(side) + " level at " + std::to_string((double) price / PRICE_FACTOR)};
-            return it->second;
+        //both sides at once; returns {bid levels written, ask levels written}
+        std::pair<std::size_t, std::size_t> snapshotDepth(std::span<LevelData> bids, std::span<LevelData> asks) noexcept {
+            return {snapshotDepth(B, bids), snapshotDepth(S, asks)};
+        }
+
+        //visits every level on a side, best price first
+        template<class F>
+        void forEachLevel(Side side, F&& f) {
+            for (auto const& pl : activeLevels(side)) f(pl);
+        }
+
+        //keep up to maxLevels emptied levels per side (for at most maxAge) instead of erasing them,
+        //so an order arriving at a just-emptied price reuses the level; 0 erases immediately (default)
+        void setLevelRetention(std::size_t maxLevels, timestamp maxAge) {
+            maxEmptyLevels = maxLevels;
+            maxEmptyAge = maxAge;
+        }
+
+        struct LevelStats {
+            std::size_t created = 0;
+            std::size_t reused = 0;
+            std::size_t erased = 0;
+        };
+
+        LevelStats getLevelStats() const {
+            return levelStats;
+        }
+
+        //starts the L2 delta feed (sink must accept LevelDelta); with maxDepth != 0 only the best maxDepth levels
+        //of each side are reported, including the add/delete of levels moving into or out of that range
+        void enableDeltas(std::size_t maxDepth = 0) requires std::invocable<Sink&, LevelDelta const&> {
+            deltasOn = true;
+            deltaDepth = maxDepth;
+        }
+
+        void enableL3() requires std::invocable<Sink&, L3Event const&> {
+            l3On = true;
+        }
+
+        //between beginBatch and endBatch L1 updates are held back; endBatch then emits at most one,
+        //so a multi-step exchange action (e.g. a sweep) doesn't show its intermediate states
+        void beginBatch() {
+            batchOpen = true;
+        }
+
+        void endBatch() {
+            batchOpen = false;
+            if (batchPending) {
+                batchPending = false;
+                callbackL1(batchTime);
+            }
         }
 
-        //TODO: impl getLevelDataByPrice?
+        bool inBatch() const {
+            return batchOpen;
+        }
+
+        struct L1Stats {
+            std::size_t emitted = 0;
+            std::size_t suppressed = 0; //touch checked but unchanged
+        };
+
+        L1Stats getL1Stats() const {
+            return l1Stats;
+        }
+
+        void setCallback(void(*cb)(L1Datum)) requires std::same_as<Sink, FunctionSink> {
+            sink.callback = cb;
+        }
 
-        void setCallback(void(*cb)(L1Datum)) {
-            callback = cb;
+        void setSink(Sink s) {
+            sink = s;
+        }
+
+        Sink& getSink() {
+            return sink;
         }
 
         std::string getSymbol() {
             return symbol;
         }
+
+        symbol_id getSymbolId() const {
+            return symbolId;
+        }
     private:
         std::string symbol;
-        std::unordered_map<int, Orders::iterator> ordersById;
-        //__gnu_pbds::gp_hash_table<int, Orders::iterator> ordersById;
-        sideBook bookSides[2] = {
-            sideBook(B),
-            sideBook(S)
+        symbol_id symbolId = 0;
+        typename BookPolicy::OrderIndex ordersById;
+        //__gnu_pbds::gp_hash_table<int, OrderIt> ordersById;
+        SideBook bookSides[2] = {
+            SideBook(B),
+            SideBook(S)
         };
-        L1Datum L1;
-        void(*callback)(L1Datum) = [](auto x) {}; //empty fn
+        L1Datum L1 = {0, UNDEF_PRICE, UNDEF_PRICE, 0, 0, 0, 0, 0};
+        Sink sink;
+
+        //emptied levels still in bookSides, oldest first; every other query skips them
+        struct EmptyLevel {
+            int price;
+            timestamp since;
+        };
+        std::deque<EmptyLevel> emptiedLevels[2];
+        std::size_t maxEmptyLevels = 0;
+        timestamp maxEmptyAge = 0;
+        LevelStats levelStats;
+        L1Stats l1Stats;
+
+        bool l3On = false;
+        bool deltasOn = false;
+        std::size_t deltaDepth = 0;
+
+        bool batchOpen = false;
+        bool batchPending = false;
+        timestamp batchTime = 0;
+
+        auto activeLevels(Side side) {
+            return bookSides[side].levels() | std::views::filter([](Level const& pl) { return pl.count != 0; });
+        }
+
+        void reuseEmptyLevel(int price, Side side) {
+            auto& emptied = emptiedLevels[side];
+            for (auto it = emptied.begin(); it != emptied.end(); it++) {
+                if (it->price == price) {
+                    emptied.erase(it);
+                    break;
+                }
+            }
+            levelStats.reused++;
+        }
+
+        void expireEmptyLevels(Side side, timestamp now) {
+            auto& emptied = emptiedLevels[side];
+            while (!emptied.empty() && (emptied.size() > maxEmptyLevels || now > emptied.front().since + maxEmptyAge)) {
+                bookSides[side].eraseLevel(emptied.front().price);
+                emptied.pop_front();
+                levelStats.erased++;
+            }
+        }
 
         //will create level if doesn't already exist
         //this is intended - works for addOrder, and when removing/executing the order should already exist
-        PriceLevel* getLevelPointer(int price, Side side) {
-            return &bookSides[side].priceLevels[price];
+        Level* getLevelPointer(int price, Side side) {
+            return bookSides[side].getLevel(price);
         }
 
-        Orders::iterator getOrderPtr(int id) {
+        OrderIt getOrderPtr(int id) {
             auto it = ordersById.find(id);
             if (it == ordersById.end()) throw std::invalid_argument("No order with id " + std::to_string(id));
             return it->second;
         }
 
+        //takes the order out of its level and the index; shared by cancels and full executions
+        void eraseOrder(OrderIt it, timestamp time) {
+            auto const& order = *it;
+            int orderId = order.id;
+            int price = order.price;
+            Side side = order.side;
+            bool L1Update = L1.price[order.side] == UNDEF_PRICE || order.price == L1.price[order.side] || sideBookComp<int>(order.side)(order.price, L1.price[order.side]);
+            auto pl = getLevelPointer(order.price, order.side);
+
+            pl->volume -= order.qty;
+            pl->count--;
+            int volume = pl->volume;
+            int count = pl->count;
+            if (pl->count == 0 && maxEmptyLevels == 0) {
+                bookSides[side].eraseLevel(price); //maybe not ideal performance-wise; change getLevelPointer to iterator?
+                levelStats.erased++;
+            } else {
+                pl->orders.erase(it);
+                if (pl->count == 0) emptiedLevels[side].push_back({price, time});
+                expireEmptyLevels(side, time);
+            }
+
+            ordersById.erase(orderId);
+            emitDelta(count == 0 ? LEVEL_DELETE : LEVEL_UPDATE, side, price, volume, count, time);
+            //if update occurs at or better than cur best
+            if (L1Update) {
+                //std::cout << "remove order L1 chg\n";
+                callbackL1(time);
+            }
+        }
+
+        //adds are reported once in the book, cancels/executions before they are applied
+        void emitL3(L3Action action, Order const& order, int qty, int remaining, int queuePosition, timestamp t) {
+            if constexpr (std::invocable<Sink&, L3Event const&>) {
+                if (!l3On) return;
+                auto touch = findLevelByIndex(0, order.side);
+                bool atTouch = touch != nullptr && touch->price == order.price;
+                sink(L3Event{t, symbolId, order.id, order.side, action, atTouch, order.price, qty, remaining, queuePosition});
+            }
+        }
+
+        //call once the book already reflects the change
+        void emitDelta(LevelAction action, Side side, int price, int volume, int count, timestamp t) {
+            if constexpr (std::invocable<Sink&, LevelDelta const&>) {
+                if (!deltasOn) return;
+                if (deltaDepth != 0) {
+                    //rank = active levels better than this price
+                    sideBookComp<int> better(side);
+                    std::size_t rank = 0;
+                    for (auto const& pl : activeLevels(side)) {
+                        if (rank == deltaDepth || !better(pl.price, price)) break;
+                        rank++;
+                    }
+                    if (rank == deltaDepth) return;
+                }
+                sink(LevelDelta{t, symbolId, side, action, {}, price, volume, count});
+                if (deltaDepth == 0) return;
+                //an add pushes the last reported level out of range, a delete pulls the next one in
+                if (action == LEVEL_ADD) {
+                    if (auto out = findLevelByIndex(deltaDepth, side)) sink(LevelDelta{t, symbolId, side, LEVEL_DELETE, {}, out->price, 0, 0});
+                } else if (action == LEVEL_DELETE) {
+                    if (auto in = findLevelByIndex(deltaDepth - 1, side)) sink(LevelDelta{t, symbolId, side, LEVEL_ADD, {}, in->price, in->volume, in->count});
+                }
+            }
+        }
+
         void callbackL1(timestamp t) {
-            //roll into same
-            std::tuple<int, int, int> bestBid, bestAsk;
-            try {
-                bestBid = getLevelDataByIndex(0, B);
-            } catch(std::invalid_argument e) {
-                bestBid = {UNDEF_PRICE, 0, 0};
+            if (batchOpen) {
+                batchPending = true;
+                batchTime = t;
+                return;
             }
-            try {
-                bestAsk = getLevelDataByIndex(0, S);
-            } catch(std::invalid_argument e) {
-                bestAsk = {UNDEF_PRICE, 0, 0};
+            //roll into same
+            const LevelData emptySide = {UNDEF_PRICE, 0, 0};
+            LevelData bestBid = findLevelDataByIndex(0, B).value_or(emptySide);
+            LevelData bestAsk = findLevelDataByIndex(0, S).value_or(emptySide);
+            //events at or behind the touch often leave it as it was; only real changes go out
+            if (bestBid.price == L1.price[B] && bestAsk.price == L1.price[S] &&
+                bestBid.volume == L1.volume[B] && bestAsk.volume == L1.volume[S] &&
+                bestBid.count == L1.count[B] && bestAsk.count == L1.count[S]) {
+                    l1Stats.suppressed++;
+                    return;
             }
             L1 = {
                 t,
-                std::get<0>(bestBid),
-                std::get<0>(bestAsk),
-                std::get<1>(bestBid),
-                std::get<1>(bestAsk),
-                std::get<2>(bestBid),
-                std::get<2>(bestAsk),
-                symbol
+                bestBid.price,
+                bestAsk.price,
+                bestBid.volume,
+                bestAsk.volume,
+                bestBid.count,
+                bestAsk.count,
+                symbolId
             };
             
-            callback(L1);
+            l1Stats.emitted++;
+            sink(L1);
             
-            //std::thread t1(callback, L1);
+            //std::thread t1(sink, L1);
             //t1.detach();
         }
 };
 
+using Instrument = BasicInstrument<MapBookPolicy>;
+using VectorInstrument = BasicInstrument<VectorBookPolicy>;
@@ -1,75 +1,135 @@
 //#include "include/json.hpp"
 #include "lib.cpp"
+#include "events.cpp"
+#include "config.cpp"
+#include "subscriptions.cpp"
+#include "output.cpp"
+#include "concurrency.cpp"
+#include "placement.cpp"
+#include "shards.cpp"
 #include <atomic>
+#include <deque>
 #include <fstream>
 #include <thread>
+#include <variant>
 
 //using json = nlohmann::json;
 
-std::vector<std::string> symbols;
-std::unordered_map<std::string, Instrument> instruments;
+SymbolTable symbolTable;
+SubscriptionRegistry subscriptions; //in-process consumers register here at startup
+std::unique_ptr<ConflatedL1> conflatedL1; //latest L1 per symbol for slow readers (UI, risk); set by l1.conflate
+std::unique_ptr<DeltaCsvWriter> l2Csv; //set by l2.format
+std::unique_ptr<BinaryRecordWriter<LevelDelta>> l2Binary;
 
-std::string toCsvLine(L1Datum L1d) {
-    {
-        using namespace std;
-        return to_string(L1d.exchTime) + ","
-            + L1d.symbol + ","
-            + to_string(L1d.price[0]) + ","
-            + to_string(L1d.volume[0]) + ","
-            + to_string(L1d.price[1]) + ","
-            + to_string(L1d.volume[1]);
-    }
+const size_t BUFFER_SIZE = 1024;
+
+//book threads -> writer thread hand-off, one ring per producer; what a producer does when its ring is full is set by l1.overflow
+//with l1.ordered=1 the writer merges the producers by exchTime so l1.out is the same on every run
+std::unique_ptr<MultiSpscQueue<L1Datum>> L1Queue;
+bool orderedL1 = false;
+OverflowStats L1Overflow;
+std::vector<L1Outbox> L1Outboxes; //one per producer
+WakeSignal L1Wake; //producers notify after each block they push (L1 or L2), in case the writer is parked
+WaitPolicy L1WaitPolicy = WaitPolicy::SPIN_YIELD;
+unsigned L1WaitSpins = 100;
+std::unique_ptr<L1CsvWriter> l1Csv; //l1.out, or l1.bin with l1.format=binary
+std::unique_ptr<BinaryRecordWriter<L1Datum>> l1Binary;
+
+//L2 deltas take the same route to the writer thread on their own queue, only created when l2.format is set;
+//they always block when full, since a lost delta would leave l2.out unable to rebuild the book
+std::unique_ptr<MultiSpscQueue<LevelDelta>> L2Queue;
+OverflowStats L2Overflow;
+std::vector<Outbox<LevelDelta>> L2Outboxes;
+
+void processL1(L1Datum L1D) {
+    if (l1Binary) l1Binary->write(L1D);
+    else l1Csv->write(L1D);
+}
+
+void processL2(LevelDelta const& delta) {
+    if (l2Csv) l2Csv->write(delta);
+    if (l2Binary) l2Binary->write(delta);
 }
 
-//size 10 will overflow sometimes
-const size_t BUFFER_SIZE = 1000;
+bool popL1(L1Datum& L1D) {
+    if (orderedL1) return L1Queue->tryPopOrdered(L1D, [](L1Datum const& d) { return d.exchTime; });
+    return L1Queue->tryPop(L1D);
+}
 
-std::atomic<bool> doneWriting = false;
-std::counting_semaphore<BUFFER_SIZE> numFilled{0};
-std::mutex bufferManip;
-std::binary_semaphore programDoneManip{1};
+bool popL2(LevelDelta& delta) {
+    if (!L2Queue) return false;
+    if (orderedL1) return L2Queue->tryPopOrdered(delta, [](LevelDelta const& d) { return d.exchTime; });
+    return L2Queue->tryPop(delta);
+}
 
-RingBuffer<L1Datum> L1Buf(BUFFER_SIZE, false); //set to true for testing
-std::ofstream L1Stream("l1.out");
+bool writerQueuesClosed() {
+    return L1Queue->closed() && (!L2Queue || L2Queue->closed());
+}
 
-void processL1(L1Datum L1D) {
-    L1Stream << toCsvLine(L1D) << "\n";
+bool writerQueuesEmpty() {
+    return L1Queue->empty() && (!L2Queue || L2Queue->empty());
 }
 
 void readBufferTask() {
+    L1Datum L1D;
+    LevelDelta delta;
+    Waiter waiter(L1WaitPolicy, L1Wake, L1WaitSpins);
     while (true) {
-        L1Datum L1D;
-        programDoneManip.acquire();
-        if (doneWriting) {
-            programDoneManip.release();
-            //because writeBuffer runs in the main thread, we can be sure that everything has been written to buffer already
-            {
-                std::lock_guard<std::mutex> g(bufferManip);  
-                while (L1Buf.count()) {
-                    processL1(L1Buf.get());
-                }
-                return;
-            }
+        bool gotL1 = popL1(L1D);
+        if (gotL1) processL1(L1D);
+        bool gotL2 = popL2(delta);
+        if (gotL2) processL2(delta);
+        if (gotL1 || gotL2) {
+            waiter.reset();
+        } else if (writerQueuesClosed()) {
+            //producers close their rings after their last push, so this drains everything that's left
+            while (popL1(L1D)) processL1(L1D);
+            while (popL2(delta)) processL2(delta);
+            return;
         } else {
-            programDoneManip.release();
-            numFilled.acquire();
-            {
-                std::lock_guard<std::mutex> g(bufferManip);
-                if (doneWriting && L1Buf.count() == 0) return;
-                //if (!doneWriting && L1Buf.count() == 0) std::cerr << "shouldn't happen\n";
-                processL1(L1Buf.get());
-            }
+            waiter.idle([]() { return !writerQueuesEmpty() || writerQueuesClosed(); });
         }
     }
 }
 
-void writeBuffer(L1Datum L1D) { //not a task; calls only when there's something to add
-    {
-        std::lock_guard<std::mutex> g(bufferManip);
-        if (L1Buf.add(L1D)) numFilled.release(); //should be fine?
-        //std::cout << toCsvLine(L1D) << "\n";
+//every book type main can run
+using AnyInstrument = std::variant<BasicInstrument<MapBookPolicy, WriteBufferSink>, BasicInstrument<VectorBookPolicy, WriteBufferSink>>;
+
+//indexed by symbol id; a deque so adding books never moves the ones other threads are updating
+std::deque<AnyInstrument> instruments;
+
+//picks the book backend for a symbol from config: book.<symbol>=map|vector, falling back to book.default
+AnyInstrument makeInstrument(std::string const& sym, symbol_id id, Config const& config) {
+    auto backend = config.get("book." + sym, config.get("book.default", "map"));
+    AnyInstrument ins;
+    if (backend == "vector") {
+        ins.emplace<1>(sym, id);
+    } else {
+        if (backend != "map") std::cerr << "Unknown book backend " << backend << " for " << sym << ", using map\n";
+        ins.emplace<0>(sym, id);
     }
-    //numFilled.release(); //not sure what happens when releasing past max
+    if (L2Queue) std::visit([&](auto& i) { i.enableDeltas(config.getInt("l2.depth", 0)); }, ins);
+    //l3.enabled=1 publishes enriched order events to L3_UPDATES subscribers
+    if (config.getInt("l3.enabled", 0)) std::visit([](auto& i) { i.enableL3(); }, ins);
+    return ins;
+}
+
+//batch.mode and the l1.flush_* settings, shared by every BookWorker
+BatchSettings batchSettings;
+
+//shards.count > 0 splits the symbols across that many book threads, each a BookShard with its own BookWorker;
+//the main thread then only parses and routes each book event (with its book) to the owning shard
+std::vector<std::unique_ptr<BookShard<AnyInstrument>>> shards;
+std::atomic<timestamp> parsedUpTo{0}; //exchTime of the last event the parser handed out
+
+//a worker sending its output through producer slot `producer` of the writer queues
+void connectWorker(BookWorker<AnyInstrument>& worker, std::size_t producer) {
+    worker.producer = producer;
+    worker.link = {L1Queue.get(), &L1Outboxes[producer], L2Queue.get(), L2Queue ? &L2Outboxes[producer] : nullptr, &L1Wake};
+    worker.settings = batchSettings;
+    worker.conflated = conflatedL1.get();
+    worker.subscriptions = &subscriptions;
+    worker.pendingL1.reserve(batchSettings.flushEvents);
 }
 
 int main() {
@@ -80,136 +140,271 @@ int main() {
     //std::string type, data;
     //std::cin >> type >> data;
 
+    Config config("orderbook.cfg");
+
     auto start = std::chrono::steady_clock::now();
 
-    //in practice we would probably fetch symbol names somewhere in advance
-    //alternatively you could read market data and detect when a new symbol appears, initializing a new symbol and instrument when this happens
-    std::string alph = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-    for (int i = 0; i < 26; i++) {
-        symbols.push_back(alph.substr(i, 1));
+    //shards.count: book threads; 0 (the default) keeps the books on the main thread
+    std::size_t shardCount = config.getInt("shards.count", 0);
+    L1Queue = std::make_unique<MultiSpscQueue<L1Datum>>(std::max<std::size_t>(shardCount, 1), BUFFER_SIZE);
+    orderedL1 = config.getInt("l1.ordered", 0);
+    //l1.overflow: block (default), drop_newest, drop_oldest (holding back up to l1.backlog updates) or conflate
+    auto overflowPolicy = OverflowPolicy::BLOCK;
+    if (!parseOverflowPolicy(config.get("l1.overflow", "block"), overflowPolicy)) {
+        std::cerr << "Unknown l1.overflow " << config.get("l1.overflow", "") << ", blocking\n";
+    }
+    //l1.wait: how the writer waits for updates; spin, spin_yield (default) or spin_park, after l1.wait_spins polls
+    if (!parseWaitPolicy(config.get("l1.wait", "spin_yield"), L1WaitPolicy)) {
+        std::cerr << "Unknown l1.wait " << config.get("l1.wait", "") << ", using spin_yield\n";
+    }
+    L1WaitSpins = config.getInt("l1.wait_spins", 100);
+    for (std::size_t p = 0; p < L1Queue->producers(); p++) {
+        L1Outboxes.emplace_back(L1Queue->producer(p), overflowPolicy, L1Overflow, config.getInt("l1.backlog", BUFFER_SIZE), &L1Wake);
+    }
+
+    //l1.conflate=1 also keeps the latest L1 of every symbol in seqlock slots that any thread can read,
+    //for symbol ids below l1.max_symbols (later ones are still written to l1.out, only not conflated)
+    if (config.getInt("l1.conflate", 0)) conflatedL1 = std::make_unique<ConflatedL1>(config.getInt("l1.max_symbols", 1024));
+
+    //l1.output/l2.output: write (default) or mmap, which writes that file (in either format) through a MappedFile
+    auto mappedOutput = [&](std::string const& key) {
+        auto output = config.get(key, "write");
+        if (output != "write" && output != "mmap") std::cerr << "Unknown " << key << " " << output << ", using write\n";
+        return output == "mmap";
+    };
+
+    //l1.format: csv (default, l1.out) or binary (l1.bin, L1Datum records; l1tocsv turns it into l1.out)
+    //l1.fixed_point=1 writes prices in l1.out as decimals instead of raw ticks
+    auto l1Format = config.get("l1.format", "csv");
+    bool l1Mapped = mappedOutput("l1.output");
+    if (l1Format == "binary") {
+        l1Binary = std::make_unique<BinaryRecordWriter<L1Datum>>("l1.bin", "L1D1", symbolTable, l1Mapped);
+    } else {
+        if (l1Format != "csv") std::cerr << "Unknown l1.format " << l1Format << ", writing csv\n";
+        l1Csv = std::make_unique<L1CsvWriter>("l1.out", symbolTable, config.getInt("l1.fixed_point", 0), 4 << 20, l1Mapped);
+    }
+
+    //l2.format: off (default), csv (l2.out) or binary (l2.bin); l2.depth limits it to the top N levels per side
+    //deltas are written by the writer thread too, reaching it through per-producer rings of l2.queue deltas
+    auto l2Format = config.get("l2.format", "off");
+    bool l2Mapped = mappedOutput("l2.output");
+    if (l2Format == "csv") l2Csv = std::make_unique<DeltaCsvWriter>("l2.out", symbolTable, 4 << 20, l2Mapped);
+    else if (l2Format == "binary") l2Binary = std::make_unique<BinaryRecordWriter<LevelDelta>>("l2.bin", "L2D1", symbolTable, l2Mapped);
+    else if (l2Format != "off") std::cerr << "Unknown l2.format " << l2Format << ", not writing L2\n";
+    if (l2Csv || l2Binary) {
+        L2Queue = std::make_unique<MultiSpscQueue<LevelDelta>>(L1Queue->producers(), config.getInt("l2.queue", 4 * BUFFER_SIZE));
+        for (std::size_t p = 0; p < L2Queue->producers(); p++) {
+            L2Outboxes.emplace_back(L2Queue->producer(p), OverflowPolicy::BLOCK, L2Overflow, 0, &L1Wake);
+        }
     }
 
-    for (auto sym : symbols) {
-        instruments[sym] = Instrument(sym);
-        instruments[sym].setCallback(&writeBuffer);
+    //cpu.main/cpu.writer and rt.main/rt.writer place the parsing+book thread and the L1 writer (cpu.shard<i>/rt.shard<i> the shards)
+    //every thread places itself, so one with its settings unset runs where the process started instead of inheriting main's
+    placeThread(config, "main");
+    std::thread readBufThread([&]() {
+        placeThread(config, "writer");
+        readBufferTask();
+    });
+
+    //batch.mode: exch_time (default) closes a batch whenever exchTime changes or at a BatchEnd line,
+    //marker closes only at BatchEnd lines, off emits every L1 update as it happens
+    auto batchMode = config.get("batch.mode", "exch_time");
+    batchSettings.batching = batchMode != "off";
+    batchSettings.byExchTime = batchMode == "exch_time";
+
+    batchSettings.flushEvents = config.getInt("l1.flush_events", 64);
+    batchSettings.flushInterval = std::chrono::microseconds(config.getInt("l1.flush_us", 100));
+
+    BookWorker<AnyInstrument> mainWorker; //unsharded, and during the sharded warm-up
+    connectWorker(mainWorker, 0);
+
+    //shards.wait: how an idle shard waits for events, like l1.wait (which it defaults to)
+    auto shardWaitPolicy = L1WaitPolicy;
+    if (!parseWaitPolicy(config.get("shards.wait", to_string(L1WaitPolicy)), shardWaitPolicy)) {
+        std::cerr << "Unknown shards.wait " << config.get("shards.wait", "") << ", using " << to_string(L1WaitPolicy) << "\n";
     }
+    std::vector<std::thread> shardThreads;
+
+    //sharded: owning shard and message count by symbol id; counts only cover the warm-up window and symbols added since
+    std::vector<BookShard<AnyInstrument>*> shardOf;
+    std::vector<std::size_t> shardLoad(shardCount);
+    std::size_t warmupEvents = config.getInt("shards.warmup", 10000);
+    std::vector<Event> warmup;
+    std::vector<std::size_t> warmupCounts;
+
+    //the id of a symbol (also the index of its book), creating the book and wiring it to its worker the first time
+    //symbols get books in id order, including any interned elsewhere (e.g. by a subscriber) before they show up in the data
+    auto bookId = [&](std::string const& sym) {
+        auto id = symbolTable.intern(sym);
+        while (instruments.size() <= id) {
+            symbol_id newId = instruments.size();
+            if (conflatedL1 && newId == conflatedL1->size()) {
+                std::cerr << "Symbol " << symbolTable.name(newId) << " and later ones are past l1.max_symbols=" << conflatedL1->size() << ", not conflated\n";
+            }
+            auto& ins = instruments.emplace_back(makeInstrument(symbolTable.name(newId), newId, config));
+            if (shards.empty()) {
+                mainWorker.assign(ins);
+            } else {
+                auto s = std::min_element(shardLoad.begin(), shardLoad.end()) - shardLoad.begin();
+                shards[s]->worker.assign(ins);
+                shardOf.push_back(shards[s].get());
+                shardLoad[s]++;
+                std::clog << "new symbol " << symbolTable.name(newId) << ": shard " << s << "\n";
+            }
+        }
+        return id;
+    };
 
-    L1Stream << "recv_time,symbol,bid_price,bid_size,ask_price,ask_size\n";
-    std::thread readBufThread(readBufferTask);
+    //per event the symbol is found by its packed key, straight from the parsed bytes;
+    //the string lookup in bookId only runs the first time a symbol is seen (or always for names over 8 bytes)
+    SymbolKeyIndex symbolKeys;
+    auto eventBookId = [&](Event const& e) {
+        auto id = symbolKeys.find(e.symbolKey);
+        if (id != SymbolKeyIndex::NOT_FOUND) return id;
+        id = bookId(e.order.symbol);
+        if (e.symbolKey != 0) symbolKeys.insert(e.symbolKey, id);
+        return id;
+    };
+
+    //symbols=A,B,... creates those books up front (ids in that order); otherwise books are created as symbols first appear
+    {
+        std::stringstream ss(config.get("symbols", ""));
+        std::string sym;
+        while (std::getline(ss, sym, ',')) {
+            if (!sym.empty()) bookId(sym);
+        }
+    }
+
+    auto startShards = [&]() {
+        auto assigned = balanceShards(instruments.size(), warmupCounts, shardCount);
+        for (std::size_t s = 0; s < shardCount; s++) {
+            shards.push_back(std::make_unique<BookShard<AnyInstrument>>(config.getInt("shards.queue", 4096), shardWaitPolicy, L1WaitSpins));
+            connectWorker(shards.back()->worker, s);
+        }
+        std::vector<std::string> shardSymbols(shardCount);
+        for (symbol_id id = 0; id < instruments.size(); id++) {
+            auto& shard = *shards[assigned[id]];
+            shard.worker.assign(instruments[id]);
+            shardOf.push_back(&shard);
+            shardSymbols[assigned[id]] += " " + symbolTable.name(id);
+            shardLoad[assigned[id]] += id < warmupCounts.size() ? warmupCounts[id] : 0;
+        }
+        for (std::size_t s = 0; s < shardCount; s++) {
+            std::clog << "shard " << s << ":" << shardSymbols[s] << " (" << shardLoad[s] << " warm-up events)\n";
+            shardThreads.emplace_back([&config, s]() {
+                placeThread(config, "shard" + std::to_string(s));
+                shards[s]->run(parsedUpTo);
+            });
+        }
+    };
+    //parser side of an event once the shards are running
+    auto route = [&](Event const& e) {
+        switch (e.type) {
+            case TRADE:
+                break;
+            case BATCH_END:
+                for (auto& shard : shards) shard->push({e, nullptr});
+                return;
+            default: {
+                auto id = eventBookId(e);
+                shardOf[id]->push({e, &instruments[id]});
+            }
+        }
+        if (e.order.exchTime != parsedUpTo.load(std::memory_order_relaxed)) {
+            parsedUpTo.store(e.order.exchTime, std::memory_order_release);
+            for (auto& shard : shards) shard->wakeUp(); //parked shards close their old batches and move their watermarks
+        }
+    };
 
     std::string type, data;
-    std::string::iterator de;
+    Event e;
     //for (int i = 0; i < 100000; i++) { std::cin >> type >> data; //use for partial reads (testing)
     while (std::cin >> type >> data) {
+        if (shardCount == 0) mainWorker.countEvent();
+
         /*auto j = json::parse(data);
 
         std::string symbol = j["symbol"].template get<std::string>();
         auto instrument = &instruments[symbol];*/
 
-        de = data.end(); //2-3s faster, surprisingly
-
-        if (type == "NewOrder:") {
-            int ct = 0;
-            Order o;
-            for (auto it = data.begin(); it != de+1; it++) {
-                auto begin = it;
-                while (it != de && *it != ':' && *it != ',' && *it != '\"')
-                    it++;
-
-                switch(ct) {
-                    case 3:
-                        o.exchTime = std::stoll(std::string(begin, it));
-                        break;
-                    case 7:
-                        o.id = std::stoi(std::string(begin, it));
-                        break;
-                    case 11:
-                        o.price = (int) (std::stod(std::string(begin, it)) * 100000);
-                        break;
-                    case 15:
-                        o.qty = std::stoi(std::string(begin, it));
-                        break;
-                    case 24:
-                        o.side = std::string(begin, it) == "B" ? B : S;
-                        break;
-                    case 30:
-                        o.symbol = std::string(begin, it);
-                        break;
-                }
-                ct++;
+        //unsharded, events are applied right here; sharded, they break out to the routing below
+        switch (parseEvent(type, data, e)) {
+            case NEW_ORDER:
+            case ORDER_CANCELED:
+            case ORDER_EXECUTED:
+            case BATCH_END:
+                if (shardCount > 0) break;
+                mainWorker.apply(e, e.type == BATCH_END ? nullptr : &instruments[eventBookId(e)]);
+                continue;
+            case TRADE: {
+                //the book itself doesn't change on trades (OrderExecuted does that)
+                auto id = symbolKeys.find(e.symbolKey);
+                if (id == SymbolKeyIndex::NOT_FOUND) id = symbolTable.find(e.order.symbol).value_or(SymbolKeyIndex::NOT_FOUND);
+                if (id != SymbolKeyIndex::NOT_FOUND) subscriptions.publish(TradeDatum{e.order.exchTime, id, e.order.price, e.order.qty});
+                if (shardCount > 0) break;
+                continue;
             }
+            default:
+                std::cerr << "Invalid type for message " << type << " " << data << "\n";
+                continue;
+        }
 
-            instruments[o.symbol].addOrder(o);
-        } else if (type == "OrderCanceled:") {
-            int ct = 0;
-            timestamp time;
-            int id;
-            std::string symbol;
-            for (auto it = data.begin(); it != de+1; it++) {
-                auto begin = it;
-                while (it != de && *it != ':' && *it != ',' && *it != '\"')
-                    it++;
-
-                switch(ct) {
-                    case 3:
-                        time = std::stoll(std::string(begin, it));
-                        break;
-                    case 7:
-                        id = std::stoi(std::string(begin, it));
-                        break;
-                    case 16:
-                        symbol = std::string(begin, it);
-                        break;
-                }
-                ct++;
+        //sharded: the first shards.warmup events only count messages per symbol, then the shards start and get everything
+        if (shards.empty()) {
+            if (e.type != TRADE && e.type != BATCH_END) {
+                auto id = eventBookId(e);
+                if (id >= warmupCounts.size()) warmupCounts.resize(id + 1);
+                warmupCounts[id]++;
             }
-            instruments[symbol].removeOrder(id, time);
-        } else if (type == "OrderExecuted:") {
-            //{"exchTime":1725413100000000,"execQty":50,"leavesQty":0,"orderId":78849,"recvTime":1725413100693106,"symbol":"F"}
-            int ct = 0;
-            timestamp time;
-            int id, execQty;
-            std::string symbol;
-            for (auto it = data.begin(); it != de+1; it++) {
-                auto begin = it;
-                while (it != de && *it != ':' && *it != ',' && *it != '\"')
-                    it++;
-
-                switch(ct) {
-                    case 3:
-                        time = std::stoll(std::string(begin, it));
-                        break;
-                    case 7:
-                        execQty = std::stoi(std::string(begin, it));
-                        break;
-                    case 15:
-                        id = std::stoi(std::string(begin, it));
-                        break;
-                    case 24:
-                        symbol = std::string(begin, it);
-                        break;
-                }
-                ct++;
-            }
-            instruments[symbol].executeOrder(id, execQty, time);
-        } else if (type == "Trade:") {
-            //don't have to do anything yet
+            warmup.push_back(e);
+            if (warmup.size() < warmupEvents) continue;
+            startShards();
+            for (auto const& w : warmup) route(w);
+            warmup.clear();
         } else {
-            std::cerr << "Invalid type for message " << type << " " << data << "\n";
+            route(e);
         }
     }
 
-    programDoneManip.acquire();
-    doneWriting = true;
-    numFilled.release();
-    programDoneManip.release();
+    if (shardCount == 0) {
+        mainWorker.finish();
+    } else {
+        if (shards.empty()) {
+            startShards();
+            for (auto const& w : warmup) route(w);
+        }
+        for (auto& shard : shards) shard->close();
+        for (auto& thread : shardThreads) thread.join();
+    }
     readBufThread.join(); //should terminate quickly
+    l1Csv.reset();
+    l1Binary.reset();
+    l2Csv.reset();
+    l2Binary.reset();
 
     //just for demonstration
     //std::cout << instruments["B"].getLevelByIndex(1, S) << "\n";
     
     auto end = std::chrono::steady_clock::now();
     std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms \n";
+
+    std::size_t l1Emitted = 0, l1Suppressed = 0;
+    for (auto& ins : instruments) {
+        std::visit([&](auto& i) {
+            l1Emitted += i.getL1Stats().emitted;
+            l1Suppressed += i.getL1Stats().suppressed;
+        }, ins);
+    }
+    std::cout << "L1 updates: " << l1Emitted << " emitted, " << l1Suppressed << " suppressed\n";
+    std::cout << "L1 queue (" << to_string(overflowPolicy) << "): " << L1Overflow.dropped << " dropped, " << L1Overflow.conflated << " conflated, "
+        << L1Overflow.fullWaits << " pushes found it full, high water " << L1Overflow.highWater << "/" << BUFFER_SIZE << "\n";
+    if (conflatedL1 && conflatedL1->rejected() != 0) {
+        std::cout << "Conflated L1: " << conflatedL1->rejected() << " updates rejected for symbols past l1.max_symbols\n";
+    }
+    if (L2Queue) {
+        std::cout << "L2 queue: " << L2Overflow.fullWaits << " pushes found it full, high water " << L2Overflow.highWater
+            << "/" << L2Queue->producer(0).getCapacity() << "\n";
+    }
     //ROUGH BENCHMARKS:
     //note that reading 100k lines takes ~3500ms
     //reading 100k lines AND getting components takes ~3800ms
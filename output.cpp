@@ -0,0 +1,400 @@
+#pragma once
+#include "lib.cpp"
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+//writers for the recorded output files: l1.out/l2.out and their binary forms
+
+//output file written with plain stores into a shared mapping instead of write(2) calls
+//space is fallocate'd and mapped growStep bytes at a time, so the writer only enters the kernel once per growStep
+//(plus page faults); close() unmaps and truncates the file to what was actually written
+class MappedFile final {
+    public:
+        explicit MappedFile(std::string const& path, std::size_t growStep = 64 << 20) : path(path), growStep(growStep) {
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) throw std::runtime_error{"Can't open " + path + ": " + std::strerror(errno)};
+        }
+
+        ~MappedFile() {
+            close();
+        }
+
+        //at least n writable bytes at the end of what has been written so far
+        char* reserve(std::size_t n) {
+            if (size + n > mapped) grow(size + n);
+            return base + size;
+        }
+
+        //everything up to end (inside the space from reserve()) is now part of the file
+        void commit(char* end) {
+            size = end - base;
+        }
+
+        std::size_t getSize() const {
+            return size;
+        }
+
+        //start of what has been written; moves when the file grows
+        char* data() {
+            return base;
+        }
+
+        void close() {
+            if (fd < 0) return;
+            if (base != nullptr) ::munmap(base, mapped);
+            base = nullptr;
+            if (::ftruncate(fd, size) != 0) std::cerr << "Truncating " << path << " failed: " << std::strerror(errno) << "\n";
+            ::close(fd);
+            fd = -1;
+        }
+    private:
+        std::string path;
+        std::size_t growStep;
+        int fd = -1;
+        char* base = nullptr;
+        std::size_t mapped = 0;
+        std::size_t size = 0;
+
+        void grow(std::size_t needed) {
+            auto newSize = mapped;
+            while (newSize < needed) newSize += growStep;
+            //fallocate reserves the blocks up front so page faults don't allocate them one by one (and ENOSPC shows up here, not as SIGBUS)
+            if (::fallocate(fd, 0, 0, newSize) != 0) {
+                if (errno != EOPNOTSUPP || ::ftruncate(fd, newSize) != 0) {
+                    throw std::runtime_error{"Can't grow " + path + ": " + std::strerror(errno)};
+                }
+            }
+            void* p = base == nullptr ? ::mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                : ::mremap(base, mapped, newSize, MREMAP_MAYMOVE);
+            if (p == MAP_FAILED) throw std::runtime_error{"Can't map " + path + ": " + std::strerror(errno)};
+            base = static_cast<char*>(p);
+            mapped = newSize;
+        }
+};
+
+//binary record files: a BinaryHeader, fixed-size records, then the symbol table as a footer
+//(the footer goes last so symbols first seen mid-run are still included; close() fills in its offset)
+struct BinaryHeader {
+    char magic[4];
+    uint32_t version;
+    int32_t priceFactor;
+    uint32_t recordSize;
+    uint64_t symbolTableOffset; //footer: uint32 count, then per symbol id a uint16 length and the name bytes
+};
+
+const uint32_t BINARY_VERSION = 2; //1 stored prices 10x larger than the priceFactor it declared
+
+//records are written as their bytes, so they must not have padding (which would carry leftover memory into the file)
+//through an ofstream by default, or with mapped a MappedFile
+template<class Record>
+class BinaryRecordWriter final {
+    static_assert(std::is_trivially_copyable_v<Record> && std::has_unique_object_representations_v<Record>);
+
+    public:
+        BinaryRecordWriter(std::string const& path, const char (&magic)[5], SymbolTable const& symbolTable, bool mapped = false)
+            : symbols(symbolTable) {
+            if (mapped) file = std::make_unique<MappedFile>(path);
+            else out.open(path, std::ios::binary);
+            BinaryHeader header = {{magic[0], magic[1], magic[2], magic[3]}, BINARY_VERSION, PRICE_FACTOR, sizeof(Record), 0};
+            append(&header, sizeof header);
+        }
+
+        ~BinaryRecordWriter() {
+            close();
+        }
+
+        void write(Record const& record) {
+            append(&record, sizeof record);
+        }
+
+        void close() {
+            if (closed) return;
+            closed = true;
+            uint64_t offset = file ? file->getSize() : (uint64_t) out.tellp();
+            uint32_t count = symbols.size();
+            append(&count, sizeof count);
+            for (symbol_id id = 0; id < count; id++) {
+                auto const& name = symbols.name(id);
+                uint16_t len = name.size();
+                append(&len, sizeof len);
+                append(name.data(), len);
+            }
+            if (file) {
+                std::memcpy(file->data() + offsetof(BinaryHeader, symbolTableOffset), &offset, sizeof offset);
+                file->close();
+            } else {
+                out.seekp(offsetof(BinaryHeader, symbolTableOffset));
+                out.write(reinterpret_cast<const char*>(&offset), sizeof offset);
+                out.close();
+            }
+        }
+    private:
+        std::ofstream out;
+        std::unique_ptr<MappedFile> file; //mapped
+        SymbolTable const& symbols;
+        bool closed = false;
+
+        void append(const void* bytes, std::size_t n) {
+            if (!file) {
+                out.write(static_cast<const char*>(bytes), n);
+                return;
+            }
+            char* p = file->reserve(n);
+            std::memcpy(p, bytes, n);
+            file->commit(p + n);
+        }
+};
+
+//reads a file written by BinaryRecordWriter; throws std::runtime_error if it's missing, of another kind or wasn't closed
+template<class Record>
+class BinaryRecordReader final {
+    static_assert(std::is_trivially_copyable_v<Record>);
+
+    public:
+        BinaryRecordReader(std::string const& path, const char (&magic)[5]) : in(path, std::ios::binary) {
+            if (!in) throw std::runtime_error{"Can't open " + path};
+            in.read(reinterpret_cast<char*>(&header), sizeof header);
+            if (!in || std::memcmp(header.magic, magic, 4) != 0) throw std::runtime_error{path + " is not a " + magic + " file"};
+            if (header.version != BINARY_VERSION || header.recordSize != sizeof(Record)) {
+                throw std::runtime_error{path + " has version " + std::to_string(header.version) + ", record size " + std::to_string(header.recordSize)};
+            }
+            if (header.symbolTableOffset == 0) throw std::runtime_error{path + " was not closed properly"};
+            remaining = (header.symbolTableOffset - sizeof header) / sizeof(Record);
+
+            in.seekg(header.symbolTableOffset);
+            uint32_t count = 0;
+            in.read(reinterpret_cast<char*>(&count), sizeof count);
+            for (uint32_t i = 0; i < count && in; i++) {
+                uint16_t len = 0;
+                in.read(reinterpret_cast<char*>(&len), sizeof len);
+                std::string name(len, '\0');
+                in.read(name.data(), len);
+                symbols.intern(name);
+            }
+            if (!in) throw std::runtime_error{path + " has a truncated symbol table"};
+            in.seekg(sizeof header);
+        }
+
+        //false once every record has been read
+        bool read(Record& record) {
+            if (remaining == 0) return false;
+            in.read(reinterpret_cast<char*>(&record), sizeof record);
+            if (!in) return false;
+            remaining--;
+            return true;
+        }
+
+        BinaryHeader const& getHeader() const {
+            return header;
+        }
+
+        //ids match the symbol ids in the records
+        SymbolTable const& getSymbols() const {
+            return symbols;
+        }
+    private:
+        std::ifstream in;
+        BinaryHeader header;
+        SymbolTable symbols;
+        uint64_t remaining = 0;
+};
+
+std::string_view to_string(LevelAction action) {
+    switch (action) {
+        case LEVEL_ADD:
+            return "add";
+        case LEVEL_UPDATE:
+            return "update";
+        default:
+            return "delete";
+    }
+}
+
+//text output formatted in place: rows are written with to_chars straight into their destination, so a row costs no allocation
+//by default that's a reusable buffer which goes to write(2) once it holds flushSize bytes (a syscall per few MB);
+//with mapped it's a MappedFile, so the writer stays out of the kernel almost entirely
+class CsvFile final {
+    public:
+        static const std::size_t MAX_SYMBOL = 64; //longer names are cut so a row always fits in MAX_ROW
+        static const std::size_t MAX_ROW = 256;
+
+        CsvFile(std::string const& path, std::size_t flushSize = 4 << 20, bool mapped = false) : path(path), flushSize(flushSize) {
+            if (mapped) {
+                file = std::make_unique<MappedFile>(path);
+            } else {
+                buffer.reset(new char[flushSize + MAX_ROW]);
+                fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0) throw std::runtime_error{"Can't open " + path + ": " + std::strerror(errno)};
+            }
+        }
+
+        ~CsvFile() {
+            close();
+        }
+
+        //room for a row
+        char* reserve() {
+            if (file) return file->reserve(MAX_ROW);
+            return buffer.get() + used;
+        }
+
+        //end is just past the row written at reserve()
+        void commit(char* end) {
+            if (file) return file->commit(end);
+            used = end - buffer.get();
+            if (used >= flushSize) flush();
+        }
+
+        //hands everything buffered to the kernel (a mapped file has nothing buffered)
+        void flush() {
+            std::size_t done = 0;
+            while (done < used && fd >= 0) {
+                auto n = ::write(fd, buffer.get() + done, used - done);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    std::cerr << "Writing " << path << " failed: " << std::strerror(errno) << "\n";
+                    ::close(fd);
+                    fd = -1;
+                    break;
+                }
+                done += n;
+            }
+            used = 0;
+        }
+
+        void close() {
+            if (file) file->close();
+            if (fd < 0) return;
+            flush();
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+
+        static void append(char*& p, std::string_view s) {
+            std::memcpy(p, s.data(), s.size());
+            p += s.size();
+        }
+
+        template<std::integral Int>
+        static void append(char*& p, Int value) {
+            p = std::to_chars(p, p + MAX_ROW, value).ptr; //the row is known to fit
+        }
+
+        static void appendSymbol(char*& p, std::string const& name) {
+            append(p, std::string_view(name).substr(0, MAX_SYMBOL));
+        }
+    private:
+        std::string path;
+        std::size_t flushSize;
+        std::unique_ptr<MappedFile> file; //mapped
+        std::unique_ptr<char[]> buffer; //otherwise
+        std::size_t used = 0;
+        int fd = -1;
+};
+
+//l1.out writer
+//prices are the raw ticks by default; fixedPointPrices writes them as decimals (ticks / PRICE_FACTOR), with undefined prices left empty
+class L1CsvWriter final {
+    public:
+        L1CsvWriter(std::string const& path, SymbolTable const& symbolTable, bool fixedPointPrices = false, std::size_t flushSize = 4 << 20, bool mapped = false)
+            : out(path, flushSize, mapped), symbols(symbolTable), fixedPoint(fixedPointPrices) {
+            char* p = out.reserve();
+            CsvFile::append(p, "recv_time,symbol,bid_price,bid_size,ask_price,ask_size\n");
+            out.commit(p);
+        }
+
+        void write(L1Datum const& L1d) {
+            char* p = out.reserve();
+            CsvFile::append(p, L1d.exchTime);
+            *p++ = ',';
+            CsvFile::appendSymbol(p, symbols.name(L1d.symbolId));
+            *p++ = ',';
+            appendPrice(p, L1d.price[0]);
+            *p++ = ',';
+            CsvFile::append(p, L1d.volume[0]);
+            *p++ = ',';
+            appendPrice(p, L1d.price[1]);
+            *p++ = ',';
+            CsvFile::append(p, L1d.volume[1]);
+            *p++ = '\n';
+            out.commit(p);
+        }
+
+        void flush() {
+            out.flush();
+        }
+
+        void close() {
+            out.close();
+        }
+    private:
+        static constexpr int priceDecimals() {
+            int digits = 0;
+            for (int f = PRICE_FACTOR; f > 1; f /= 10) digits++;
+            return digits;
+        }
+
+        CsvFile out;
+        SymbolTable const& symbols;
+        bool fixedPoint;
+
+        void appendPrice(char*& p, int price) {
+            if (!fixedPoint) return CsvFile::append(p, price);
+            if (price == UNDEF_PRICE) return;
+            if (price < 0) *p++ = '-';
+            unsigned ticks = price < 0 ? 0u - (unsigned) price : (unsigned) price;
+            CsvFile::append(p, ticks / PRICE_FACTOR);
+            if (priceDecimals() == 0) return;
+            *p++ = '.';
+            auto frac = ticks % PRICE_FACTOR;
+            for (unsigned scale = PRICE_FACTOR / 10; scale > 1 && frac < scale; scale /= 10) *p++ = '0';
+            CsvFile::append(p, frac);
+        }
+};
+
+//l2.out writer (l2.format=csv); prices are raw ticks
+class DeltaCsvWriter final {
+    public:
+        DeltaCsvWriter(std::string const& path, SymbolTable const& symbolTable, std::size_t flushSize = 4 << 20, bool mapped = false)
+            : out(path, flushSize, mapped), symbols(symbolTable) {
+            char* p = out.reserve();
+            CsvFile::append(p, "exch_time,symbol,side,action,price,volume,count\n");
+            out.commit(p);
+        }
+
+        void write(LevelDelta const& d) {
+            char* p = out.reserve();
+            CsvFile::append(p, d.exchTime);
+            *p++ = ',';
+            CsvFile::appendSymbol(p, symbols.name(d.symbolId));
+            *p++ = ',';
+            *p++ = d.side == B ? 'B' : 'S';
+            *p++ = ',';
+            CsvFile::append(p, to_string(d.action));
+            *p++ = ',';
+            CsvFile::append(p, d.price);
+            *p++ = ',';
+            CsvFile::append(p, d.volume);
+            *p++ = ',';
+            CsvFile::append(p, d.count);
+            *p++ = '\n';
+            out.commit(p);
+        }
+
+        void flush() {
+            out.flush();
+        }
+
+        void close() {
+            out.close();
+        }
+    private:
+        CsvFile out;
+        SymbolTable const& symbols;
+};
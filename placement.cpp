@@ -0,0 +1,113 @@
+#pragma once
+#include "config.cpp"
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <vector>
+
+//pinning pipeline threads (main, writer, book shards, ...) to CPUs from config:
+//  cpu.<thread>=2 or 2,3 or 4-7   (unset: any CPU the process may use)
+//  rt.<thread>=<priority>         SCHED_FIFO at that priority; usually needs CAP_SYS_NICE or an rtprio limit (unset: the process's policy)
+//a SCHED_FIFO thread that spins or yields starves everything else on its CPUs, so give it cores of its own
+
+//"2,4-6" -> {2, 4, 5, 6}; malformed parts are skipped with a warning
+std::vector<int> parseCpuList(std::string const& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string part;
+    while (std::getline(ss, part, ',')) {
+        if (part.empty()) continue;
+        try {
+            auto dash = part.find('-');
+            int first = std::stoi(part.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(part.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+        } catch (std::exception const&) {
+            std::cerr << "Bad CPU list entry " << part << "\n";
+        }
+    }
+    return cpus;
+}
+
+//{0, 1, 2, 5} -> "0-2,5"
+std::string formatCpuList(cpu_set_t const& set) {
+    std::ostringstream out;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set)) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &set)) last++;
+        if (out.tellp() > 0) out << ",";
+        out << cpu;
+        if (last > cpu) out << "-" << last;
+        cpu = last;
+    }
+    return out.str();
+}
+
+//the CPUs and scheduling the process started with, read before main() so before any thread has been placed
+//a new thread inherits its creator's mask and policy, so placeThread puts a thread with cpu.<name>/rt.<name> unset back to these
+struct ProcessPlacement {
+    cpu_set_t cpus;
+    int policy = SCHED_OTHER;
+    sched_param param{};
+
+    ProcessPlacement() {
+        CPU_ZERO(&cpus);
+        if (sched_getaffinity(0, sizeof cpus, &cpus) != 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &cpus);
+        }
+        if (pthread_getschedparam(pthread_self(), &policy, &param) != 0) {
+            policy = SCHED_OTHER;
+            param = {};
+        }
+    }
+};
+
+inline const ProcessPlacement processPlacement;
+
+//applies cpu.<name>/rt.<name> to the calling thread, resetting whichever is unset to the process's original placement,
+//and logs what the kernel reports afterwards; failures are logged, not fatal
+void placeThread(Config const& config, std::string const& name) {
+    std::ostringstream log;
+    log << "thread " << name << ":";
+
+    auto cpus = parseCpuList(config.get("cpu." + name, ""));
+    cpu_set_t set = processPlacement.cpus;
+    if (cpus.empty()) {
+        log << " cpu." << name << " unset";
+    } else {
+        CPU_ZERO(&set);
+        log << " cpu." << name << "=";
+        for (std::size_t i = 0; i < cpus.size(); i++) {
+            if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i], &set);
+            log << (i > 0 ? "," : "") << cpus[i];
+        }
+    }
+    if (int err = pthread_setaffinity_np(pthread_self(), sizeof set, &set)) log << " (failed: " << std::strerror(err) << ")";
+
+    int policy = processPlacement.policy;
+    sched_param param = processPlacement.param;
+    if (int priority = config.getInt("rt." + name, 0); priority > 0) {
+        policy = SCHED_FIFO;
+        param = {};
+        param.sched_priority = priority;
+        log << ", rt." << name << "=" << priority;
+    } else {
+        log << ", rt." << name << " unset";
+    }
+    if (int err = pthread_setschedparam(pthread_self(), policy, &param)) log << " (failed: " << std::strerror(err) << ")";
+
+    log << " -> cpus ";
+    cpu_set_t actual;
+    CPU_ZERO(&actual);
+    if (sched_getaffinity(0, sizeof actual, &actual) == 0) log << formatCpuList(actual);
+    else log << "unknown";
+    if (pthread_getschedparam(pthread_self(), &policy, &param) == 0) {
+        if (policy == SCHED_FIFO) log << ", SCHED_FIFO " << param.sched_priority;
+        else if (policy == SCHED_RR) log << ", SCHED_RR " << param.sched_priority;
+        else log << ", SCHED_OTHER";
+    }
+    log << ", running on cpu " << sched_getcpu() << "\n";
+    std::clog << log.str();
+}
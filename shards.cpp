@@ -0,0 +1,293 @@
+#pragma once
+#include "lib.cpp"
+#include "events.cpp"
+#include "concurrency.cpp"
+#include "subscriptions.cpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <span>
+#include <thread>
+#include <variant>
+#include <vector>
+
+//book threads: a BookWorker applies events to a set of books and hands their output to the writer thread;
+//main runs one on its own thread, or with shards.count > 0 one per BookShard, each fed by the parser through a ring
+
+//compile-time sink so the enqueue can be inlined into the book update
+//L1 updates and L2 deltas go to the owning BookWorker's pending blocks, so the writer hand-off is done a block at a time
+struct WriteBufferSink {
+    std::vector<L1Datum>* pending = nullptr;
+    std::vector<LevelDelta>* pendingL2 = nullptr;
+    ConflatedL1* conflated = nullptr;
+    SubscriptionRegistry* subscriptions = nullptr;
+
+    void operator()(L1Datum const& L1D) const {
+        pending->push_back(L1D);
+        if (conflated) conflated->publish(L1D);
+        if (subscriptions) subscriptions->publish(L1D);
+    }
+
+    void operator()(L3Event const& event) const {
+        if (subscriptions) subscriptions->publish(event);
+    }
+
+    //only called once enableDeltas has been, i.e. with L2 output on
+    void operator()(LevelDelta const& delta) const {
+        pendingL2->push_back(delta);
+    }
+};
+
+//batch.mode and the l1.flush_* settings
+struct BatchSettings {
+    bool batching = true;   //off: every L1 update goes out as it happens
+    bool byExchTime = true; //exch_time: a batch also closes whenever exchTime changes (otherwise only at BatchEnd)
+    std::size_t flushEvents = 64;
+    std::chrono::microseconds flushInterval{100};
+};
+
+//a BookWorker's producer slot in the writer thread's queues
+struct WriterLink {
+    MultiSpscQueue<L1Datum>* l1Queue = nullptr;
+    L1Outbox* l1Outbox = nullptr;
+    MultiSpscQueue<LevelDelta>* l2Queue = nullptr; //both null without L2 output
+    Outbox<LevelDelta>* l2Outbox = nullptr;
+    WakeSignal* wake = nullptr; //notified after every block pushed
+};
+
+//the books one thread updates with their open batch and pending L1/L2 blocks
+//Book is a std::variant of BasicInstruments whose sink is WriteBufferSink
+template<class Book>
+struct BookWorker {
+    std::size_t producer = 0;
+    WriterLink link;
+    BatchSettings settings;
+    ConflatedL1* conflated = nullptr;
+    SubscriptionRegistry* subscriptions = nullptr;
+
+    std::vector<L1Datum> pendingL1;
+    std::vector<LevelDelta> pendingL2;
+    std::vector<Book*> batchTouched;
+    timestamp batchTime = 0; //exch_time mode: exchTime of the open batch
+    timestamp batchStart = 0; //exchTime of the open batch's first event
+    timestamp lastEventTime = 0; //exchTime of the open batch's latest event; depth published when the batch closes carries it
+    std::size_t sinceFlush = 0;
+    std::chrono::steady_clock::time_point lastFlush = std::chrono::steady_clock::now();
+
+    //book's updates go to this worker from now on
+    void assign(Book& book) {
+        std::visit([&](auto& i) { i.setSink(WriteBufferSink{&pendingL1, &pendingL2, conflated, subscriptions}); }, book);
+    }
+
+    //hands the pending blocks to the writer, each with one publish to its ring
+    void flush() {
+        if (!pendingL1.empty()) {
+            link.l1Outbox->push(std::span<const L1Datum>(pendingL1));
+            pendingL1.clear();
+            link.wake->notify();
+        }
+        if (!pendingL2.empty()) {
+            link.l2Outbox->push(std::span<const LevelDelta>(pendingL2));
+            pendingL2.clear();
+            link.wake->notify();
+        }
+    }
+
+    //pending updates go to the writer every flushEvents input events or after flushInterval, whichever comes first
+    void countEvent() {
+        if (++sinceFlush >= settings.flushEvents
+                || ((!pendingL1.empty() || !pendingL2.empty()) && std::chrono::steady_clock::now() - lastFlush >= settings.flushInterval)) {
+            flush();
+            sinceFlush = 0;
+            lastFlush = std::chrono::steady_clock::now();
+        }
+    }
+
+    void closeBatch() {
+        auto first = pendingL1.size();
+        for (auto book : batchTouched) std::visit([&](auto& i) {
+            i.endBatch();
+            if (subscriptions) subscriptions->publishDepth(i, lastEventTime);
+        }, *book);
+        batchTouched.clear();
+        //a marker batch stamps each book's update with that book's last change, so they go out in exchTime order for the ordered merge
+        if (!settings.byExchTime) {
+            std::stable_sort(pendingL1.begin() + first, pendingL1.end(), [](L1Datum const& a, L1Datum const& b) { return a.exchTime < b.exchTime; });
+        }
+    }
+
+    //adds book to the open batch, first closing the batch if the event starts a new one
+    void enterBatch(Event const& e, Book& book) {
+        if (!settings.batching) return;
+        if (settings.byExchTime && e.order.exchTime != batchTime) {
+            closeBatch();
+            batchTime = e.order.exchTime;
+        }
+        if (batchTouched.empty()) batchStart = e.order.exchTime;
+        lastEventTime = e.order.exchTime; //after closing the old batch, whose depth goes out with its own time
+        std::visit([&](auto& i) {
+            if (!i.inBatch()) {
+                i.beginBatch();
+                batchTouched.push_back(&book);
+            }
+        }, book);
+    }
+
+    //depth subscribers see a book once per batch, like L1, so they don't get the intermediate states of one exchange action either
+    template<class Ins>
+    void publishDepth(Ins& i, timestamp t) {
+        if (subscriptions && !i.inBatch()) subscriptions->publishDepth(i, t);
+    }
+
+    //book events and BatchEnd; book may be null for BatchEnd
+    void apply(Event const& e, Book* book) {
+        switch (e.type) {
+            case NEW_ORDER:
+                enterBatch(e, *book);
+                std::visit([&](auto& i) {
+                    i.addOrder(e.order);
+                    publishDepth(i, e.order.exchTime);
+                }, *book);
+                break;
+            case ORDER_CANCELED:
+                enterBatch(e, *book);
+                std::visit([&](auto& i) {
+                    i.removeOrder(e.order.id, e.order.exchTime);
+                    publishDepth(i, e.order.exchTime);
+                }, *book);
+                break;
+            case ORDER_EXECUTED:
+                enterBatch(e, *book);
+                std::visit([&](auto& i) {
+                    i.executeOrder(e.order.id, e.order.qty, e.order.exchTime);
+                    publishDepth(i, e.order.exchTime);
+                }, *book);
+                break;
+            case BATCH_END:
+                closeBatch();
+                break;
+            default:
+                break;
+        }
+    }
+
+    //this worker has applied every event the parser handed out up to exchTime upTo (and nothing later is queued for it):
+    //an exch_time batch older than that is complete, and nothing this worker sends later is older than upTo (L2, which isn't batched)
+    //or its open batch (L1), which the watermarks tell the writer's ordered merge
+    //false while L1 updates held back by the outbox (DROP_OLDEST/CONFLATE) still don't fit: call again, they're older than the mark
+    bool caughtUp(timestamp upTo) {
+        if (settings.byExchTime && !batchTouched.empty() && batchTime < upTo) closeBatch();
+        flush();
+        if (link.l2Queue) link.l2Queue->setWatermark(producer, upTo);
+        if (link.l1Outbox->held() != 0) {
+            bool done = link.l1Outbox->tryFlush();
+            link.wake->notify();
+            if (!done) return false;
+        }
+        link.l1Queue->setWatermark(producer, batchTouched.empty() ? upTo : batchStart);
+        return true;
+    }
+
+    //after the last event: everything goes to the writer and this worker's rings are closed
+    void finish() {
+        closeBatch();
+        flush();
+        link.l1Outbox->flush();
+        link.l1Queue->producer(producer).close();
+        if (link.l2Queue) link.l2Queue->producer(producer).close();
+        link.wake->notify();
+    }
+};
+
+//one book thread's input: the events for its books, each with the book it applies to (null for BatchEnd)
+template<class Book>
+struct ShardTask {
+    Event event;
+    Book* book;
+};
+
+//a BookWorker fed through a ring by the parser; run() is the shard thread's body and waits for tasks under a WaitPolicy
+//the parser sets parsedUpTo after each event it routes, and calls wakeUp() on every shard when that moves to a new exchTime,
+//so a parked shard with nothing to do still closes its old batch and lets the writer's ordered merge past it
+template<class Book>
+class BookShard final {
+    public:
+        BookWorker<Book> worker;
+
+        BookShard(std::size_t queueSize, WaitPolicy waitPolicy = WaitPolicy::SPIN_YIELD, unsigned waitSpins = 100)
+            : tasks(queueSize), waitPolicy(waitPolicy), waitSpins(waitSpins) {}
+
+        //parser only; waits for room if the ring is full
+        void push(ShardTask<Book> const& task) {
+            while (!tasks.tryPush(task)) std::this_thread::yield();
+            if (waitPolicy == WaitPolicy::SPIN_PARK) wake.notify();
+        }
+
+        void wakeUp() {
+            if (waitPolicy == WaitPolicy::SPIN_PARK) wake.notify();
+        }
+
+        //parser only, after its last push
+        void close() {
+            tasks.close();
+            wake.notify();
+        }
+
+        //applies tasks until the ring is closed and drained, then finishes the worker
+        void run(std::atomic<timestamp> const& parsedUpTo) {
+            ShardTask<Book> task;
+            Waiter waiter(waitPolicy, wake, waitSpins);
+            timestamp seenUpTo = 0;
+            bool applied = false; //since the last caughtUp
+            bool holding = false; //the last caughtUp left L1 updates held back
+            while (true) {
+                if (tasks.tryPop(task)) {
+                    worker.countEvent();
+                    worker.apply(task.event, task.book);
+                    applied = true;
+                    waiter.reset();
+                } else if (tasks.closed()) {
+                    while (tasks.tryPop(task)) worker.apply(task.event, task.book);
+                    worker.finish();
+                    return;
+                } else {
+                    //upTo is read before the ring is seen empty, so everything routed up to it has been applied
+                    auto upTo = parsedUpTo.load(std::memory_order_acquire);
+                    if (tasks.peek() != nullptr) continue;
+                    if (applied || holding || upTo != seenUpTo) {
+                        holding = !worker.caughtUp(upTo);
+                        seenUpTo = upTo;
+                        applied = false;
+                    }
+                    //holding: keeps polling (never parks) until the writer has made room for the held updates
+                    waiter.idle([&]() {
+                        return holding || tasks.peek() != nullptr || tasks.closed() || parsedUpTo.load(std::memory_order_acquire) != seenUpTo;
+                    });
+                }
+            }
+        }
+    private:
+        SpscRing<ShardTask<Book>> tasks;
+        WakeSignal wake;
+        WaitPolicy waitPolicy;
+        unsigned waitSpins;
+};
+
+//spreads symbol ids 0..symbolCount-1 over the shards using their message counts from the warm-up window (indexed by id):
+//busiest symbol first, each to the shard with the fewest messages so far (symbols not seen count as one)
+std::vector<std::size_t> balanceShards(std::size_t symbolCount, std::vector<std::size_t> const& counts, std::size_t shardCount) {
+    auto countOf = [&](std::size_t id) {
+        return id < counts.size() ? std::max<std::size_t>(counts[id], 1) : 1;
+    };
+    std::vector<std::size_t> order(symbolCount);
+    for (std::size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) { return countOf(a) > countOf(b); });
+
+    std::vector<std::size_t> assigned(symbolCount), load(shardCount);
+    for (auto id : order) {
+        auto shard = std::min_element(load.begin(), load.end()) - load.begin();
+        assigned[id] = shard;
+        load[shard] += countOf(id);
+    }
+    return assigned;
+}
@@ -0,0 +1,189 @@
+#pragma once
+#include "lib.cpp"
+#include "concurrency.cpp"
+#include <array>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+//fan-out of book updates to several consumers (strategy, recorder, monitor, ...)
+//each subscriber picks symbols and update kinds and gets its own queues; symbols nobody asked for cost one lookup
+
+enum UpdateKind : unsigned {
+    L1_UPDATES = 1,
+    DEPTH_UPDATES = 2,
+    TRADE_UPDATES = 4,
+    L3_UPDATES = 8
+};
+
+const std::size_t DEPTH_LEVELS = 5;
+
+//top DEPTH_LEVELS of each side; levels past bidLevels/askLevels are unused
+struct DepthDatum {
+    timestamp exchTime;
+    symbol_id symbolId;
+    int bidLevels;
+    int askLevels;
+    LevelData bids[DEPTH_LEVELS];
+    LevelData asks[DEPTH_LEVELS];
+};
+
+struct TradeDatum {
+    timestamp exchTime;
+    symbol_id symbolId;
+    int price;
+    int qty;
+};
+
+//queues are filled by the book threads (with shards, several of them, hence the lock) and drained by the subscriber's own thread
+//through the poll functions; a full queue applies the subscriber's OverflowPolicy and every update lost is counted in that
+//queue's OverflowStats: BLOCK waits for the subscriber to poll, DROP_NEWEST discards the new update, DROP_OLDEST (the default)
+//overwrites the oldest queued one
+class Subscriber final {
+    public:
+        explicit Subscriber(std::size_t queueSize, OverflowPolicy policy = OverflowPolicy::DROP_OLDEST)
+            : queueSize(std::max<std::size_t>(queueSize, 1)), policy(policy), l1(this->queueSize), depth(this->queueSize), trades(this->queueSize), orders(this->queueSize) {
+            if (policy == OverflowPolicy::CONFLATE) throw std::invalid_argument{"Subscribers can't conflate"};
+        }
+
+        bool poll(L1Datum& out) {
+            return take(l1, out);
+        }
+
+        bool poll(DepthDatum& out) {
+            return take(depth, out);
+        }
+
+        bool poll(TradeDatum& out) {
+            return take(trades, out);
+        }
+
+        bool poll(L3Event& out) {
+            return take(orders, out);
+        }
+
+        OverflowStats const& getOverflowStats(UpdateKind kind) const {
+            switch (kind) {
+                case L1_UPDATES: return l1.stats;
+                case DEPTH_UPDATES: return depth.stats;
+                case TRADE_UPDATES: return trades.stats;
+                default: return orders.stats;
+            }
+        }
+    private:
+        friend class SubscriptionRegistry;
+
+        template<class T>
+        struct Queue {
+            RingBuffer<T> items;
+            OverflowStats stats;
+
+            explicit Queue(std::size_t size) : items(size) {}
+        };
+
+        std::size_t queueSize;
+        OverflowPolicy policy;
+        std::mutex queueManip;
+        Queue<L1Datum> l1;
+        Queue<DepthDatum> depth;
+        Queue<TradeDatum> trades;
+        Queue<L3Event> orders;
+
+        template<class T>
+        void push(Queue<T>& queue, T const& datum) {
+            bool counted = false;
+            while (true) {
+                {
+                    std::lock_guard<std::mutex> g(queueManip);
+                    if (queue.items.count() < queueSize) {
+                        queue.items.add(datum);
+                        if (queue.items.count() > queue.stats.highWater.load(std::memory_order_relaxed)) {
+                            queue.stats.highWater.store(queue.items.count(), std::memory_order_relaxed);
+                        }
+                        return;
+                    }
+                    if (!counted) queue.stats.fullWaits.fetch_add(1, std::memory_order_relaxed);
+                    counted = true;
+                    if (policy != OverflowPolicy::BLOCK) {
+                        if (policy == OverflowPolicy::DROP_OLDEST) queue.items.add(datum); //overwrites the oldest
+                        queue.stats.dropped.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                }
+                std::this_thread::yield(); //BLOCK: outside the lock so the subscriber can poll
+            }
+        }
+
+        template<class T>
+        bool take(Queue<T>& queue, T& out) {
+            std::lock_guard<std::mutex> g(queueManip);
+            if (queue.items.count() == 0) return false;
+            out = queue.items.get();
+            return true;
+        }
+};
+
+class SubscriptionRegistry final {
+    public:
+        //kinds is a mask of UpdateKind; the returned subscriber lives as long as the registry
+        //policy is what happens when one of its queues is full (BLOCK stalls the book thread until the subscriber polls)
+        Subscriber& subscribe(std::vector<symbol_id> const& symbols, unsigned kinds, std::size_t queueSize = 1000,
+                OverflowPolicy policy = OverflowPolicy::DROP_OLDEST) {
+            subscribers.push_back(std::make_unique<Subscriber>(queueSize, policy));
+            auto sub = subscribers.back().get();
+            for (auto sym : symbols) {
+                if (sym >= bySymbol.size()) bySymbol.resize(sym + 1);
+                auto& entry = bySymbol[sym];
+                entry.kinds |= kinds;
+                for (std::size_t k = 0; k < KINDS; k++) {
+                    if (kinds & (1u << k)) entry.subscribers[k].push_back(sub);
+                }
+            }
+            return *sub;
+        }
+
+        bool wants(symbol_id sym, UpdateKind kind) const {
+            return sym < bySymbol.size() && (bySymbol[sym].kinds & kind);
+        }
+
+        void publish(L1Datum const& L1d) {
+            if (!wants(L1d.symbolId, L1_UPDATES)) return;
+            for (auto sub : bySymbol[L1d.symbolId].subscribers[0]) sub->push(sub->l1, L1d);
+        }
+
+        void publish(DepthDatum const& depth) {
+            if (!wants(depth.symbolId, DEPTH_UPDATES)) return;
+            for (auto sub : bySymbol[depth.symbolId].subscribers[1]) sub->push(sub->depth, depth);
+        }
+
+        void publish(TradeDatum const& trade) {
+            if (!wants(trade.symbolId, TRADE_UPDATES)) return;
+            for (auto sub : bySymbol[trade.symbolId].subscribers[2]) sub->push(sub->trades, trade);
+        }
+
+        void publish(L3Event const& event) {
+            if (!wants(event.symbolId, L3_UPDATES)) return;
+            for (auto sub : bySymbol[event.symbolId].subscribers[3]) sub->push(sub->orders, event);
+        }
+
+        //snapshots the instrument's top levels only if someone subscribed to its depth
+        template<class Ins>
+        void publishDepth(Ins& ins, timestamp t) {
+            if (!wants(ins.getSymbolId(), DEPTH_UPDATES)) return;
+            DepthDatum depth{t, ins.getSymbolId(), 0, 0, {}, {}};
+            auto [bidLevels, askLevels] = ins.snapshotDepth(depth.bids, depth.asks);
+            depth.bidLevels = bidLevels;
+            depth.askLevels = askLevels;
+            publish(depth);
+        }
+    private:
+        static const std::size_t KINDS = 4;
+
+        struct SymbolSubscribers {
+            unsigned kinds = 0;
+            std::array<std::vector<Subscriber*>, KINDS> subscribers; //indexed by bit position of the UpdateKind
+        };
+
+        std::vector<std::unique_ptr<Subscriber>> subscribers;
+        std::vector<SymbolSubscribers> bySymbol; //indexed by symbol id
+};
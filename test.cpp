@@ -2,6 +2,15 @@
 #define CATCH_CONFIG_MAIN
 #include "include/catch.hpp"
 #include "lib.cpp"
+#include "events.cpp"
+#include "subscriptions.cpp"
+#include "output.cpp"
+#include "concurrency.cpp"
+#include "placement.cpp"
+#include "shards.cpp"
+#include <deque>
+#include <set>
+#include <thread>
 
 TEST_CASE("Order equality") {
     Order o1 = {
@@ -114,8 +123,8 @@ TEST_CASE("PriceLevel equality") {
     REQUIRE(p3 == p3);
 }
 
-TEST_CASE("adding") {
-    Instrument ins("A");
+TEMPLATE_TEST_CASE("adding", "", Instrument, VectorInstrument) {
+    TestType ins("A");
 
     SECTION("empty properly throws") {
         REQUIRE_THROWS(ins.getOrderById(0));
@@ -218,8 +227,8 @@ TEST_CASE("adding") {
     }
 }
 
-TEST_CASE("removing") {
-    Instrument ins("A");
+TEMPLATE_TEST_CASE("removing", "", Instrument, VectorInstrument) {
+    TestType ins("A");
     Order o1 = {
         0,
         4,
@@ -268,8 +277,8 @@ TEST_CASE("removing") {
     }
 }
 
-TEST_CASE("executing") {
-    Instrument ins("A");
+TEMPLATE_TEST_CASE("executing", "", Instrument, VectorInstrument) {
+    TestType ins("A");
     Order o1 = {
         0,
         4,
@@ -323,4 +332,1456 @@ TEST_CASE("executing") {
         ins.addOrder(o1);
         REQUIRE_THROWS(ins.executeOrder(51, 30, 0));
     }
-}
\ No newline at end of file
+}
+
+TEMPLATE_TEST_CASE("level ordering", "", Instrument, VectorInstrument) {
+    TestType ins("A");
+    int bidPrices[] = {1000, 1200, 900, 1100, 1150};
+    int askPrices[] = {1500, 1300, 1700, 1400, 1350};
+    for (int i = 0; i < 5; i++) {
+        ins.addOrder({i, 0, bidPrices[i], 10, B, "A"});
+        ins.addOrder({i + 5, 0, askPrices[i], 10, S, "A"});
+    }
+
+    SECTION("best price first on both sides") {
+        int expectedBids[] = {1200, 1150, 1100, 1000, 900};
+        int expectedAsks[] = {1300, 1350, 1400, 1500, 1700};
+        for (int i = 0; i < 5; i++) {
+            REQUIRE(std::get<0>(ins.getLevelDataByIndex(i, B)) == expectedBids[i]);
+            REQUIRE(std::get<0>(ins.getLevelDataByIndex(i, S)) == expectedAsks[i]);
+        }
+        REQUIRE_THROWS(ins.getLevelDataByIndex(5, B));
+    }
+
+    SECTION("removing levels in the middle and at the touch") {
+        ins.removeOrder(3, 0); //bid 1100
+        ins.removeOrder(6, 0); //ask 1300
+        REQUIRE(std::get<0>(ins.getLevelDataByIndex(1, B)) == 1150);
+        REQUIRE(std::get<0>(ins.getLevelDataByIndex(2, B)) == 1000);
+        REQUIRE(std::get<0>(ins.getLevelDataByIndex(0, S)) == 1350);
+        REQUIRE_THROWS(ins.getLevelByPrice(1100, B));
+        REQUIRE(ins.getOrderById(0).price == 1000); //orders on shifted levels are still reachable
+        ins.removeOrder(0, 0);
+        REQUIRE_THROWS(ins.getLevelByPrice(1000, B));
+    }
+}
+
+TEMPLATE_TEST_CASE("non-throwing queries", "", Instrument, VectorInstrument) {
+    TestType ins("A");
+
+    SECTION("empty book") {
+        REQUIRE(ins.findOrderById(0) == nullptr);
+        REQUIRE(ins.findLevelByIndex(0, B) == nullptr);
+        REQUIRE(ins.findLevelByPrice(195900, S) == nullptr);
+        REQUIRE_FALSE(ins.findLevelDataByIndex(0, S).has_value());
+        REQUIRE_FALSE(ins.findLevelDataByPrice(195900, B).has_value());
+        REQUIRE_THROWS(ins.getLevelDataByPrice(195900, B));
+    }
+
+    Order o1 = {0, 4, 195900, 50, S, "A"};
+    Order o2 = {1, 5, 195900, 20, S, "A"};
+    Order o3 = {2, 6, 196000, 30, S, "A"};
+    ins.addOrder(o1);
+    ins.addOrder(o2);
+    ins.addOrder(o3);
+
+    SECTION("present entries") {
+        REQUIRE(ins.findOrderById(1) != nullptr);
+        REQUIRE(*ins.findOrderById(1) == o2);
+        REQUIRE(ins.findLevelByIndex(1, S) == &ins.getLevelByPrice(196000, S));
+
+        auto touch = ins.findLevelDataByIndex(0, S);
+        REQUIRE(touch.has_value());
+        REQUIRE(touch->price == 195900);
+        REQUIRE(touch->volume == 70);
+        REQUIRE(touch->count == 2);
+
+        auto deeper = ins.findLevelDataByPrice(196000, S);
+        REQUIRE(deeper.has_value());
+        REQUIRE(deeper->volume == 30);
+        REQUIRE(ins.getLevelDataByPrice(196000, S) == std::tuple<int, int, int>{196000, 30, 1});
+    }
+
+    SECTION("missing entries") {
+        REQUIRE(ins.findLevelByIndex(2, S) == nullptr);
+        REQUIRE(ins.findLevelByIndex(0, B) == nullptr);
+        REQUIRE_FALSE(ins.findLevelDataByPrice(195950, S).has_value());
+        ins.removeOrder(2, 7);
+        REQUIRE(ins.findOrderById(2) == nullptr);
+        REQUIRE_FALSE(ins.findLevelDataByPrice(196000, S).has_value());
+    }
+}
+
+TEMPLATE_TEST_CASE("depth snapshot", "", Instrument, VectorInstrument) {
+    TestType ins("A");
+    LevelData bids[3], asks[3];
+
+    SECTION("empty book writes nothing") {
+        REQUIRE(ins.snapshotDepth(B, bids) == 0);
+        REQUIRE(ins.snapshotDepth(bids, asks) == std::pair<std::size_t, std::size_t>{0, 0});
+    }
+
+    ins.addOrder({0, 0, 1000, 10, B, "A"});
+    ins.addOrder({1, 0, 1100, 20, B, "A"});
+    ins.addOrder({2, 0, 1100, 5, B, "A"});
+    ins.addOrder({3, 0, 900, 30, B, "A"});
+    ins.addOrder({4, 0, 800, 40, B, "A"});
+    ins.addOrder({5, 0, 1200, 15, S, "A"});
+
+    SECTION("buffer smaller than book") {
+        REQUIRE(ins.snapshotDepth(B, bids) == 3);
+        REQUIRE(bids[0].price == 1100);
+        REQUIRE(bids[0].volume == 25);
+        REQUIRE(bids[0].count == 2);
+        REQUIRE(bids[1].price == 1000);
+        REQUIRE(bids[2].price == 900);
+    }
+
+    SECTION("both sides, book smaller than buffer") {
+        auto [nBids, nAsks] = ins.snapshotDepth(bids, asks);
+        REQUIRE(nBids == 3);
+        REQUIRE(nAsks == 1);
+        REQUIRE(asks[0].price == 1200);
+        REQUIRE(asks[0].volume == 15);
+        REQUIRE(asks[0].count == 1);
+    }
+}
+
+TEMPLATE_TEST_CASE("empty level retention", "", Instrument, VectorInstrument) {
+    TestType ins("A");
+    ins.setLevelRetention(2, 100);
+    ins.addOrder({0, 0, 1000, 10, B, "A"});
+    ins.addOrder({1, 0, 1100, 20, B, "A"});
+    ins.removeOrder(1, 10);
+
+    SECTION("emptied level is invisible") {
+        REQUIRE(ins.getLevelByIndex(0, B).price == 1000);
+        REQUIRE_THROWS(ins.getLevelByIndex(1, B));
+        REQUIRE_THROWS(ins.getLevelByPrice(1100, B));
+        LevelData bids[2];
+        REQUIRE(ins.snapshotDepth(B, bids) == 1);
+        REQUIRE(ins.getLevelStats().created == 2);
+        REQUIRE(ins.getLevelStats().erased == 0);
+    }
+
+    SECTION("re-adding at the same price reuses the level") {
+        ins.addOrder({2, 20, 1100, 5, B, "A"});
+        REQUIRE(ins.getLevelByIndex(0, B).price == 1100);
+        REQUIRE(ins.getLevelByIndex(0, B).volume == 5);
+        REQUIRE(ins.getLevelByIndex(0, B).count == 1);
+        REQUIRE(ins.getLevelStats().created == 2);
+        REQUIRE(ins.getLevelStats().reused == 1);
+    }
+
+    SECTION("bounded by count") {
+        ins.addOrder({2, 20, 1200, 5, B, "A"});
+        ins.addOrder({3, 20, 1300, 5, B, "A"});
+        ins.removeOrder(2, 30);
+        ins.removeOrder(3, 30);
+        REQUIRE(ins.getLevelStats().erased == 1);
+        REQUIRE(ins.getLevelByIndex(0, B).price == 1000);
+    }
+
+    SECTION("bounded by age") {
+        ins.addOrder({2, 200, 1200, 5, B, "A"});
+        REQUIRE(ins.getLevelStats().erased == 1);
+        ins.addOrder({3, 200, 1100, 5, B, "A"});
+        REQUIRE(ins.getLevelStats().reused == 0);
+        REQUIRE(ins.getLevelByIndex(1, B).price == 1100);
+    }
+}
+
+std::vector<L1Datum> receivedL1;
+void recordL1(L1Datum L1d) {
+    receivedL1.push_back(L1d);
+}
+
+TEMPLATE_TEST_CASE("L1 only on touch changes", "", Instrument, VectorInstrument) {
+    TestType ins("A");
+    receivedL1.clear();
+    ins.setCallback(&recordL1);
+
+    ins.addOrder({0, 1, 1000, 10, B, "A"});
+    REQUIRE(receivedL1.size() == 1);
+    REQUIRE(receivedL1.back().price[B] == 1000);
+    REQUIRE(receivedL1.back().volume[B] == 10);
+    REQUIRE(receivedL1.back().price[S] == UNDEF_PRICE);
+
+    SECTION("changes behind the touch are silent") {
+        ins.addOrder({1, 2, 900, 10, B, "A"});
+        ins.removeOrder(1, 3);
+        REQUIRE(receivedL1.size() == 1);
+    }
+
+    SECTION("volume and count changes at the touch are emitted") {
+        ins.addOrder({1, 2, 1000, 5, B, "A"});
+        REQUIRE(receivedL1.size() == 2);
+        REQUIRE(receivedL1.back().volume[B] == 15);
+        REQUIRE(receivedL1.back().count[B] == 2);
+        ins.executeOrder(0, 5, 3);
+        REQUIRE(receivedL1.size() == 3);
+        REQUIRE(receivedL1.back().volume[B] == 10);
+        REQUIRE(receivedL1.back().exchTime == 3);
+    }
+
+    SECTION("counters") {
+        ins.addOrder({1, 2, 1100, 5, B, "A"});
+        ins.removeOrder(1, 3);
+        REQUIRE(ins.getL1Stats().emitted == 3);
+        ins.addOrder({2, 4, 2000, 5, S, "A"});
+        ins.addOrder({3, 4, 2100, 5, S, "A"});
+        REQUIRE(ins.getL1Stats().emitted == 4);
+        REQUIRE(ins.getL1Stats().suppressed == 0);
+        ins.removeOrder(3, 5);
+        REQUIRE(ins.getL1Stats().emitted == 4);
+        ins.executeOrder(2, 0, 6); //at the touch but changes nothing
+        REQUIRE(ins.getL1Stats().emitted == 4);
+        REQUIRE(ins.getL1Stats().suppressed == 1);
+        REQUIRE(receivedL1.size() == 4);
+    }
+}
+
+TEMPLATE_TEST_CASE("L1 batches", "", Instrument, VectorInstrument) {
+    TestType ins("A");
+    receivedL1.clear();
+    ins.setCallback(&recordL1);
+    ins.addOrder({0, 1, 1000, 10, S, "A"});
+    ins.addOrder({1, 1, 1010, 10, S, "A"});
+    ins.addOrder({2, 1, 1020, 10, S, "A"});
+    receivedL1.clear();
+
+    SECTION("sweep emits once at the end") {
+        ins.beginBatch();
+        REQUIRE(ins.inBatch());
+        ins.executeOrder(0, 10, 5);
+        ins.executeOrder(1, 10, 5);
+        ins.executeOrder(2, 4, 5);
+        REQUIRE(receivedL1.empty());
+        ins.endBatch();
+        REQUIRE_FALSE(ins.inBatch());
+        REQUIRE(receivedL1.size() == 1);
+        REQUIRE(receivedL1.back().price[S] == 1020);
+        REQUIRE(receivedL1.back().volume[S] == 6);
+        REQUIRE(receivedL1.back().exchTime == 5);
+    }
+
+    SECTION("batch that restores the touch emits nothing") {
+        ins.beginBatch();
+        ins.removeOrder(0, 5);
+        ins.addOrder({3, 5, 1000, 10, S, "A"});
+        ins.endBatch();
+        REQUIRE(receivedL1.empty());
+    }
+
+    SECTION("empty batch emits nothing") {
+        ins.beginBatch();
+        ins.endBatch();
+        REQUIRE(receivedL1.empty());
+    }
+}
+
+TEST_CASE("symbol table") {
+    SymbolTable table;
+    REQUIRE(table.intern("AAPL") == 0);
+    REQUIRE(table.intern("MSFT") == 1);
+    REQUIRE(table.intern("AAPL") == 0);
+    REQUIRE(table.size() == 2);
+    REQUIRE(table.name(1) == "MSFT");
+    REQUIRE(table.find("MSFT") == 1u);
+    REQUIRE_FALSE(table.find("GOOG").has_value());
+
+    auto const* msft = &table.name(1);
+    for (int i = 0; i < 3000; i++) table.intern("S" + std::to_string(i));
+    REQUIRE(table.size() == 3002);
+    REQUIRE(table.name(2501) == "S2499");
+    REQUIRE(&table.name(1) == msft); //names never move, so other threads can hold on to them while new symbols arrive
+
+    Instrument ins("MSFT", table.intern("MSFT"));
+    receivedL1.clear();
+    ins.setCallback(&recordL1);
+    ins.addOrder({0, 1, 1000, 10, B, "MSFT"});
+    REQUIRE(receivedL1.back().symbolId == 1);
+    REQUIRE(table.name(receivedL1.back().symbolId) == "MSFT");
+}
+
+TEST_CASE("packed symbol keys") {
+    REQUIRE(packSymbol("") == 0);
+    REQUIRE(packSymbol("TOOLONGSYM") == 0);
+    REQUIRE(packSymbol("A") != packSymbol("AA"));
+    REQUIRE(packSymbol("ABCDEFGH") == packSymbol(std::string("xABCDEFGHx").substr(1, 8)));
+
+    SymbolKeyIndex index;
+    REQUIRE(index.find(packSymbol("A")) == SymbolKeyIndex::NOT_FOUND);
+    REQUIRE(index.find(0) == SymbolKeyIndex::NOT_FOUND);
+    for (symbol_id id = 0; id < 1000; id++) index.insert(packSymbol("S" + std::to_string(id)), id); //grows several times
+    REQUIRE(index.size() == 1000);
+    bool allFound = true;
+    for (symbol_id id = 0; id < 1000; id++) allFound &= index.find(packSymbol("S" + std::to_string(id))) == id;
+    REQUIRE(allFound);
+    REQUIRE(index.find(packSymbol("S1000")) == SymbolKeyIndex::NOT_FOUND);
+}
+
+struct RecordingSink {
+    std::vector<L1Datum>* out;
+    void operator()(L1Datum const& L1d) const {
+        out->push_back(L1d);
+    }
+};
+
+TEST_CASE("compile-time L1 sink") {
+    std::vector<L1Datum> updates;
+    BasicInstrument<MapBookPolicy, RecordingSink> ins("A", 3);
+    ins.setSink({&updates});
+    ins.addOrder({0, 1, 1000, 10, B, "A"});
+    ins.addOrder({1, 2, 900, 10, B, "A"});
+    ins.addOrder({2, 3, 1100, 10, S, "A"});
+    REQUIRE(updates.size() == 2);
+    REQUIRE(updates.back().symbolId == 3);
+    REQUIRE(updates.back().price[S] == 1100);
+    REQUIRE(ins.getSink().out == &updates);
+}
+
+TEST_CASE("subscriptions") {
+    SubscriptionRegistry registry;
+    auto& strategy = registry.subscribe({0, 1}, L1_UPDATES | DEPTH_UPDATES);
+    auto& recorder = registry.subscribe({1}, L1_UPDATES | TRADE_UPDATES);
+
+    REQUIRE(registry.wants(0, L1_UPDATES));
+    REQUIRE_FALSE(registry.wants(0, TRADE_UPDATES));
+    REQUIRE(registry.wants(1, TRADE_UPDATES));
+    REQUIRE_FALSE(registry.wants(2, L1_UPDATES));
+
+    L1Datum L1d;
+    DepthDatum depth;
+    TradeDatum trade;
+
+    SECTION("updates only reach matching subscribers") {
+        registry.publish(L1Datum{5, 1000, 1100, 10, 10, 1, 1, 0});
+        registry.publish(L1Datum{6, 1000, 1100, 20, 10, 2, 1, 1});
+        registry.publish(L1Datum{7, 1000, 1100, 20, 10, 2, 1, 2}); //nobody wants symbol 2
+        registry.publish(TradeDatum{8, 1, 1100, 5});
+
+        REQUIRE(strategy.poll(L1d));
+        REQUIRE(L1d.symbolId == 0);
+        REQUIRE(strategy.poll(L1d));
+        REQUIRE(L1d.symbolId == 1);
+        REQUIRE_FALSE(strategy.poll(L1d));
+        REQUIRE_FALSE(strategy.poll(trade));
+
+        REQUIRE(recorder.poll(L1d));
+        REQUIRE(L1d.exchTime == 6);
+        REQUIRE_FALSE(recorder.poll(L1d));
+        REQUIRE(recorder.poll(trade));
+        REQUIRE(trade.qty == 5);
+    }
+
+    SECTION("depth snapshots from an instrument") {
+        Instrument ins("A", 0);
+        ins.addOrder({0, 1, 1000, 10, B, "A"});
+        ins.addOrder({1, 1, 990, 10, B, "A"});
+        registry.publishDepth(ins, 1);
+        REQUIRE(strategy.poll(depth));
+        REQUIRE(depth.bidLevels == 2);
+        REQUIRE(depth.askLevels == 0);
+        REQUIRE(depth.bids[1].price == 990);
+        REQUIRE_FALSE(recorder.poll(depth));
+
+        Instrument other("C", 2);
+        other.addOrder({0, 1, 1000, 10, B, "C"});
+        registry.publishDepth(other, 1);
+        REQUIRE_FALSE(strategy.poll(depth));
+    }
+}
+
+TEST_CASE("subscriber overflow") {
+    SubscriptionRegistry registry;
+    L1Datum L1d;
+    auto publish = [&](timestamp n) {
+        for (timestamp t = 1; t <= n; t++) registry.publish(L1Datum{t, {1000, 1100}, {10, 10}, {1, 1}, 0});
+    };
+
+    SECTION("drop_oldest keeps the latest and counts what it overwrote") {
+        auto& sub = registry.subscribe({0}, L1_UPDATES, 2);
+        publish(5);
+        REQUIRE(sub.poll(L1d));
+        REQUIRE(L1d.exchTime == 4);
+        REQUIRE(sub.poll(L1d));
+        REQUIRE(L1d.exchTime == 5);
+        REQUIRE_FALSE(sub.poll(L1d));
+        REQUIRE(sub.getOverflowStats(L1_UPDATES).dropped == 3);
+        REQUIRE(sub.getOverflowStats(L1_UPDATES).highWater == 2);
+        REQUIRE(sub.getOverflowStats(DEPTH_UPDATES).dropped == 0);
+    }
+
+    SECTION("drop_newest keeps the oldest") {
+        auto& sub = registry.subscribe({0}, L1_UPDATES, 2, OverflowPolicy::DROP_NEWEST);
+        publish(5);
+        REQUIRE(sub.poll(L1d));
+        REQUIRE(L1d.exchTime == 1);
+        REQUIRE(sub.poll(L1d));
+        REQUIRE(L1d.exchTime == 2);
+        REQUIRE_FALSE(sub.poll(L1d));
+        REQUIRE(sub.getOverflowStats(L1_UPDATES).dropped == 3);
+        REQUIRE(sub.getOverflowStats(L1_UPDATES).fullWaits == 3);
+    }
+
+    SECTION("block loses nothing") {
+        auto& sub = registry.subscribe({0}, L1_UPDATES, 2, OverflowPolicy::BLOCK);
+        const std::size_t N = 1000;
+        std::vector<timestamp> seen;
+        std::thread consumer([&]() {
+            L1Datum d;
+            while (seen.size() < N) {
+                if (sub.poll(d)) seen.push_back(d.exchTime);
+                else std::this_thread::yield();
+            }
+        });
+        publish(N);
+        consumer.join();
+        bool inOrder = true;
+        for (std::size_t i = 0; i < N; i++) inOrder &= seen[i] == i + 1;
+        REQUIRE(inOrder);
+        REQUIRE(sub.getOverflowStats(L1_UPDATES).dropped == 0);
+    }
+
+    REQUIRE_THROWS_AS(registry.subscribe({0}, L1_UPDATES, 2, OverflowPolicy::CONFLATE), std::invalid_argument);
+}
+
+//rebuilds a side's levels from the deltas it receives
+struct DepthCopySink {
+    std::map<int, LevelData>* copies; //indexed by side
+    std::vector<LevelDelta>* deltas;
+
+    void operator()(L1Datum const&) const {}
+
+    void operator()(LevelDelta const& d) const {
+        deltas->push_back(d);
+        if (d.action == LEVEL_DELETE) copies[d.side].erase(d.price);
+        else copies[d.side][d.price] = {d.price, d.volume, d.count};
+    }
+};
+
+TEMPLATE_TEST_CASE("L2 deltas", "", MapBookPolicy, VectorBookPolicy) {
+    std::map<int, LevelData> copies[2];
+    std::vector<LevelDelta> deltas;
+    BasicInstrument<TestType, DepthCopySink> ins("A", 4);
+    ins.setSink({copies, &deltas});
+
+    SECTION("actions") {
+        ins.enableDeltas();
+        ins.addOrder({0, 1, 1000, 10, B, "A"});
+        ins.addOrder({1, 2, 1000, 5, B, "A"});
+        ins.executeOrder(0, 3, 3);
+        ins.removeOrder(0, 4);
+        ins.removeOrder(1, 5);
+        REQUIRE(deltas.size() == 5);
+        REQUIRE(deltas[0].action == LEVEL_ADD);
+        REQUIRE(deltas[0].symbolId == 4);
+        REQUIRE(deltas[1].action == LEVEL_UPDATE);
+        REQUIRE(deltas[1].volume == 15);
+        REQUIRE(deltas[2].volume == 12);
+        REQUIRE(deltas[3].count == 1);
+        REQUIRE(deltas[4].action == LEVEL_DELETE);
+        REQUIRE(deltas[4].exchTime == 5);
+    }
+
+    SECTION("disabled by default") {
+        ins.addOrder({0, 1, 1000, 10, B, "A"});
+        REQUIRE(deltas.empty());
+    }
+
+    SECTION("copy kept from deltas matches the book") {
+        std::size_t depth = GENERATE(0, 3);
+        ins.enableDeltas(depth);
+        std::vector<int> live;
+        unsigned seed = 7;
+        auto next = [&]() { return seed = seed * 1103515245 + 12345, (seed >> 16) & 0x7fff; };
+        for (int id = 0; id < 400; id++) {
+            if (live.size() > 5 && next() % 3 == 0) {
+                std::size_t pick = next() % live.size();
+                if (next() % 2) ins.removeOrder(live[pick], id);
+                else ins.executeOrder(live[pick], ins.getOrderById(live[pick]).qty, id);
+                live.erase(live.begin() + pick);
+            } else if (!live.empty() && next() % 4 == 0) {
+                ins.executeOrder(live.back(), 0, id);
+            } else {
+                Side side = next() % 2 ? B : S;
+                int price = side == B ? 1000 - 10 * (next() % 8) : 1010 + 10 * (next() % 8);
+                ins.addOrder({id, (timestamp) id, price, 1 + (int) (next() % 20), side, "A"});
+                live.push_back(id);
+            }
+
+            for (Side side : {B, S}) {
+                LevelData book[20];
+                std::size_t n = ins.snapshotDepth(side, depth == 0 ? std::span<LevelData>(book) : std::span<LevelData>(book, depth));
+                REQUIRE(copies[side].size() == n);
+                for (std::size_t i = 0; i < n; i++) {
+                    auto it = copies[side].find(book[i].price);
+                    REQUIRE(it != copies[side].end());
+                    REQUIRE(it->second.volume == book[i].volume);
+                    REQUIRE(it->second.count == book[i].count);
+                }
+            }
+        }
+    }
+}
+
+struct L3BufferSink {
+    RingBuffer<L3Event>* buffer;
+
+    void operator()(L1Datum const&) const {}
+
+    void operator()(L3Event const& event) const {
+        buffer->add(event);
+    }
+};
+
+TEMPLATE_TEST_CASE("L3 events", "", MapBookPolicy, VectorBookPolicy) {
+    RingBuffer<L3Event> events(100);
+    BasicInstrument<TestType, L3BufferSink> ins("A", 2);
+    ins.setSink({&events});
+
+    SECTION("disabled by default") {
+        ins.addOrder({0, 1, 1000, 10, B, "A"});
+        REQUIRE(events.count() == 0);
+    }
+
+    SECTION("enriched events") {
+        ins.enableL3();
+        ins.addOrder({0, 1, 1000, 10, B, "A"});
+        ins.addOrder({1, 2, 1000, 20, B, "A"});
+        ins.addOrder({2, 3, 990, 30, B, "A"});
+        ins.executeOrder(1, 5, 4);
+        ins.executeOrder(0, 10, 5);
+        ins.removeOrder(2, 6);
+        REQUIRE(events.count() == 6);
+
+        auto e = events.get();
+        REQUIRE(e.action == ORDER_ADD);
+        REQUIRE(e.symbolId == 2);
+        REQUIRE(e.queuePosition == 0);
+        REQUIRE(e.atTouch);
+
+        e = events.get();
+        REQUIRE(e.queuePosition == 1);
+        REQUIRE(e.remainingQty == 20);
+
+        e = events.get();
+        REQUIRE(e.price == 990);
+        REQUIRE_FALSE(e.atTouch);
+
+        e = events.get();
+        REQUIRE(e.action == ORDER_EXECUTE);
+        REQUIRE(e.orderId == 1);
+        REQUIRE(e.qty == 5);
+        REQUIRE(e.remainingQty == 15);
+        REQUIRE(e.queuePosition == -1);
+
+        e = events.get();
+        REQUIRE(e.action == ORDER_EXECUTE);
+        REQUIRE(e.remainingQty == 0);
+        REQUIRE(e.exchTime == 5);
+
+        e = events.get();
+        REQUIRE(e.action == ORDER_CANCEL);
+        REQUIRE(e.qty == 30);
+        REQUIRE_FALSE(e.atTouch);
+    }
+}
+
+TEST_CASE("conflated L1") {
+    ConflatedL1 slots(4);
+    L1Datum L1d;
+    REQUIRE_FALSE(slots.latest(1, L1d));
+    REQUIRE_FALSE(slots.latest(10, L1d));
+
+    REQUIRE(slots.publish(L1Datum{1, 1000, 1100, 10, 20, 1, 2, 1}));
+    REQUIRE(slots.publish(L1Datum{2, 1000, 1100, 15, 20, 2, 2, 1}));
+    REQUIRE(slots.publish(L1Datum{3, 990, 1010, 5, 5, 1, 1, 3}));
+    REQUIRE(slots.rejected() == 0);
+    REQUIRE_FALSE(slots.publish(L1Datum{4, 990, 1010, 5, 5, 1, 1, 4})); //past the table
+    REQUIRE_FALSE(slots.publish(L1Datum{5, 990, 1010, 5, 5, 1, 1, 10}));
+    REQUIRE(slots.rejected() == 2);
+    REQUIRE_FALSE(slots.latest(4, L1d));
+    REQUIRE(slots.version(4) == 0);
+    REQUIRE(slots.latest(1, L1d));
+    REQUIRE(L1d.exchTime == 2);
+    REQUIRE(L1d.volume[B] == 15);
+    REQUIRE(slots.version(1) == 2);
+    REQUIRE(slots.version(0) == 0);
+
+    SECTION("readers always see a whole update") {
+        std::atomic<bool> done = false;
+        std::thread writer([&]() {
+            for (int i = 1; i <= 200000; i++) slots.publish(L1Datum{(timestamp) i, i, i, i, i, i, i, 2});
+            done = true;
+        });
+        bool consistent = true;
+        while (!done) {
+            if (slots.latest(2, L1d)) {
+                int i = L1d.price[B];
+                consistent &= L1d.exchTime == (timestamp) i && L1d.price[S] == i && L1d.volume[B] == i && L1d.volume[S] == i && L1d.count[B] == i && L1d.count[S] == i;
+            }
+        }
+        writer.join();
+        REQUIRE(consistent);
+        REQUIRE(slots.latest(2, L1d));
+        REQUIRE(L1d.exchTime == 200000);
+    }
+}
+
+TEST_CASE("SPSC ring") {
+    SpscRing<int> ring(3);
+    REQUIRE(ring.getCapacity() == 4);
+    int x;
+    REQUIRE_FALSE(ring.tryPop(x));
+
+    SECTION("fills up and wraps") {
+        for (int i = 0; i < 4; i++) REQUIRE(ring.tryPush(i));
+        REQUIRE_FALSE(ring.tryPush(4));
+        REQUIRE(ring.tryPop(x));
+        REQUIRE(x == 0);
+        REQUIRE(ring.tryPush(4));
+        for (int i = 1; i <= 4; i++) {
+            REQUIRE(ring.tryPop(x));
+            REQUIRE(x == i);
+        }
+        REQUIRE(ring.size() == 0);
+    }
+
+    SECTION("block pushes take what fits") {
+        std::vector<int> values{0, 1, 2, 3, 4, 5};
+        std::span<const int> block(values);
+        REQUIRE(ring.tryPush(block) == 4);
+        REQUIRE(ring.tryPush(block.subspan(4)) == 0);
+        REQUIRE(ring.tryPop(x));
+        REQUIRE(x == 0);
+        REQUIRE(ring.tryPush(block.subspan(4)) == 1);
+        for (int i = 1; i <= 4; i++) {
+            REQUIRE(ring.tryPop(x));
+            REQUIRE(x == i);
+        }
+        REQUIRE_FALSE(ring.tryPop(x));
+    }
+
+    SECTION("drains everything across threads") {
+        const int N = 100000;
+        SpscRing<int> shared(256);
+        std::thread producer([&]() {
+            for (int i = 0; i < N; i++) {
+                while (!shared.tryPush(i)) std::this_thread::yield();
+            }
+            shared.close();
+        });
+        int expected = 0;
+        bool inOrder = true;
+        while (true) {
+            if (shared.tryPop(x)) {
+                inOrder &= x == expected++;
+            } else if (shared.closed()) {
+                while (shared.tryPop(x)) inOrder &= x == expected++;
+                break;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        producer.join();
+        REQUIRE(inOrder);
+        REQUIRE(expected == N);
+    }
+}
+
+TEST_CASE("multi-producer queue") {
+    MultiSpscQueue<L1Datum> queue(3, 64);
+    L1Datum L1d;
+    REQUIRE(queue.producers() == 3);
+    REQUIRE_FALSE(queue.tryPop(L1d));
+    auto key = [](L1Datum const& d) { return d.exchTime; };
+
+    SECTION("round robin takes from every producer") {
+        queue.producer(0).tryPush(L1Datum{1, {}, {}, {}, 0});
+        queue.producer(0).tryPush(L1Datum{2, {}, {}, {}, 0});
+        queue.producer(2).tryPush(L1Datum{3, {}, {}, {}, 0});
+        REQUIRE(queue.tryPop(L1d));
+        REQUIRE(L1d.exchTime == 1);
+        REQUIRE(queue.tryPop(L1d));
+        REQUIRE(L1d.exchTime == 3);
+        REQUIRE(queue.tryPop(L1d));
+        REQUIRE(L1d.exchTime == 2);
+        REQUIRE_FALSE(queue.tryPop(L1d));
+    }
+
+    SECTION("ordered pop waits for open producers") {
+        queue.producer(0).tryPush(L1Datum{5, {}, {}, {}, 0});
+        queue.producer(1).tryPush(L1Datum{3, {}, {}, {}, 0});
+        REQUIRE_FALSE(queue.tryPopOrdered(L1d, key)); //producer 2 might still send something earlier
+        queue.producer(2).close();
+        REQUIRE_FALSE(queue.closed());
+        REQUIRE(queue.tryPopOrdered(L1d, key));
+        REQUIRE(L1d.exchTime == 3);
+        REQUIRE_FALSE(queue.tryPopOrdered(L1d, key));
+        queue.producer(1).close();
+        queue.producer(0).close();
+        REQUIRE(queue.closed());
+        REQUIRE(queue.tryPopOrdered(L1d, key));
+        REQUIRE(L1d.exchTime == 5);
+        REQUIRE_FALSE(queue.tryPopOrdered(L1d, key));
+    }
+
+    SECTION("watermarks let the merge past idle producers") {
+        queue.producer(0).tryPush(L1Datum{5, {}, {}, {}, 0});
+        queue.producer(1).tryPush(L1Datum{7, {}, {}, {}, 0});
+        queue.setWatermark(2, 4);
+        REQUIRE_FALSE(queue.tryPopOrdered(L1d, key));
+        queue.setWatermark(2, 6);
+        REQUIRE(queue.tryPopOrdered(L1d, key));
+        REQUIRE(L1d.exchTime == 5);
+        REQUIRE_FALSE(queue.tryPopOrdered(L1d, key)); //producer 0 is idle now too
+        queue.setWatermark(0, 10);
+        REQUIRE_FALSE(queue.tryPopOrdered(L1d, key));
+        queue.setWatermark(2, 7);
+        REQUIRE(queue.tryPopOrdered(L1d, key));
+        REQUIRE(L1d.exchTime == 7);
+        queue.producer(2).tryPush(L1Datum{9, {}, {}, {}, 0});
+        queue.setWatermark(1, 9); //producer 1 could still send a 9, which would go first
+        REQUIRE_FALSE(queue.tryPopOrdered(L1d, key));
+        queue.setWatermark(1, 10);
+        REQUIRE(queue.tryPopOrdered(L1d, key));
+        REQUIRE(L1d.exchTime == 9);
+    }
+
+    SECTION("ordered merge across threads") {
+        const int N = 20000;
+        std::vector<std::thread> producers;
+        for (int p = 0; p < 3; p++) {
+            producers.emplace_back([&, p]() {
+                for (int i = 0; i < N; i++) {
+                    while (!queue.producer(p).tryPush(L1Datum{(timestamp) (i * 3 + p), {}, {}, {}, 0})) std::this_thread::yield();
+                }
+                queue.producer(p).close();
+            });
+        }
+        timestamp expected = 0;
+        bool inOrder = true;
+        while (true) {
+            if (queue.tryPopOrdered(L1d, key)) {
+                inOrder &= L1d.exchTime == expected++;
+            } else if (queue.closed()) {
+                while (queue.tryPopOrdered(L1d, key)) inOrder &= L1d.exchTime == expected++;
+                break;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        for (auto& t : producers) t.join();
+        REQUIRE(inOrder);
+        REQUIRE(expected == 3 * N);
+    }
+}
+
+TEST_CASE("L1 overflow policies") {
+    SpscRing<L1Datum> ring(4);
+    OverflowStats stats;
+    auto update = [](timestamp t, symbol_id sym) {
+        L1Datum L1d{t, {}, {}, {}, 0};
+        L1d.symbolId = sym;
+        return L1d;
+    };
+    auto drain = [&]() {
+        std::vector<timestamp> times;
+        L1Datum L1d;
+        while (ring.tryPop(L1d)) times.push_back(L1d.exchTime);
+        return times;
+    };
+
+    SECTION("drop newest") {
+        L1Outbox outbox(ring, OverflowPolicy::DROP_NEWEST, stats);
+        for (timestamp t = 1; t <= 6; t++) outbox.push(update(t, 0));
+        REQUIRE(stats.dropped == 2);
+        REQUIRE(stats.fullWaits == 2);
+        REQUIRE(stats.highWater == 4);
+        REQUIRE(drain() == std::vector<timestamp>{1, 2, 3, 4});
+    }
+
+    SECTION("drop oldest") {
+        L1Outbox outbox(ring, OverflowPolicy::DROP_OLDEST, stats, 2);
+        for (timestamp t = 1; t <= 8; t++) outbox.push(update(t, 0));
+        REQUIRE(outbox.held() == 2);
+        REQUIRE(stats.dropped == 2);
+        REQUIRE(drain() == std::vector<timestamp>{1, 2, 3, 4});
+        outbox.push(update(9, 0));
+        REQUIRE(outbox.held() == 0);
+        REQUIRE(drain() == std::vector<timestamp>{7, 8, 9});
+    }
+
+    SECTION("conflate per symbol") {
+        L1Outbox outbox(ring, OverflowPolicy::CONFLATE, stats);
+        for (timestamp t = 1; t <= 4; t++) outbox.push(update(t, 0));
+        outbox.push(update(5, 1));
+        outbox.push(update(6, 2));
+        outbox.push(update(7, 1));
+        outbox.push(update(8, 2));
+        outbox.push(update(9, 1));
+        REQUIRE(outbox.held() == 2);
+        REQUIRE(stats.conflated == 3);
+        REQUIRE(stats.dropped == 0);
+        REQUIRE(drain() == std::vector<timestamp>{1, 2, 3, 4});
+        outbox.flush();
+        REQUIRE(drain() == std::vector<timestamp>{8, 9});
+    }
+
+    SECTION("blocks of updates get the same policies") {
+        std::vector<L1Datum> block;
+        for (timestamp t = 1; t <= 8; t++) block.push_back(update(t, t > 4 ? t % 2 : 0));
+
+        L1Outbox dropNewest(ring, OverflowPolicy::DROP_NEWEST, stats);
+        dropNewest.push(std::span<const L1Datum>(block));
+        REQUIRE(stats.dropped == 4);
+        REQUIRE(stats.fullWaits == 4);
+        REQUIRE(stats.highWater == 4);
+        REQUIRE(drain() == std::vector<timestamp>{1, 2, 3, 4});
+
+        L1Outbox dropOldest(ring, OverflowPolicy::DROP_OLDEST, stats, 2);
+        dropOldest.push(std::span<const L1Datum>(block));
+        REQUIRE(dropOldest.held() == 2);
+        REQUIRE(stats.dropped == 6);
+        REQUIRE(drain() == std::vector<timestamp>{1, 2, 3, 4});
+        dropOldest.push(std::span<const L1Datum>(block).first(1));
+        REQUIRE(drain() == std::vector<timestamp>{7, 8, 1});
+
+        L1Outbox conflate(ring, OverflowPolicy::CONFLATE, stats);
+        conflate.push(std::span<const L1Datum>(block));
+        REQUIRE(conflate.held() == 2);
+        REQUIRE(stats.conflated == 2);
+        REQUIRE(drain() == std::vector<timestamp>{1, 2, 3, 4});
+        conflate.flush();
+        REQUIRE(drain() == std::vector<timestamp>{7, 8});
+    }
+
+    SECTION("block delivers everything") {
+        L1Outbox outbox(ring, OverflowPolicy::BLOCK, stats);
+        const timestamp N = 10000;
+        std::thread producer([&]() {
+            std::vector<L1Datum> block;
+            std::size_t blockSize = 1;
+            for (timestamp t = 1; t <= N; t++) {
+                if (t < N / 2) {
+                    outbox.push(update(t, 0));
+                    continue;
+                }
+                block.push_back(update(t, 0)); //the second half goes in blocks of 1 to 7, some larger than the ring
+                if (block.size() == blockSize || t == N) {
+                    outbox.push(std::span<const L1Datum>(block));
+                    block.clear();
+                    blockSize = blockSize % 7 + 1;
+                }
+            }
+            ring.close();
+        });
+        timestamp expected = 1;
+        bool inOrder = true;
+        L1Datum L1d;
+        while (true) {
+            if (ring.tryPop(L1d)) {
+                inOrder &= L1d.exchTime == expected++;
+            } else if (ring.closed()) {
+                while (ring.tryPop(L1d)) inOrder &= L1d.exchTime == expected++;
+                break;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        producer.join();
+        REQUIRE(inOrder);
+        REQUIRE(expected == N + 1);
+        REQUIRE(stats.dropped == 0);
+    }
+
+    OverflowPolicy policy;
+    REQUIRE(parseOverflowPolicy("drop_oldest", policy));
+    REQUIRE(policy == OverflowPolicy::DROP_OLDEST);
+    REQUIRE_FALSE(parseOverflowPolicy("sometimes", policy));
+    REQUIRE(policy == OverflowPolicy::DROP_OLDEST);
+}
+
+TEST_CASE("L1 CSV writer") {
+    SymbolTable table;
+    table.intern("A");
+    table.intern("BC");
+    auto path = "l1_csv_test.out";
+    auto readBack = [&]() {
+        std::ifstream in(path);
+        std::stringstream ss;
+        ss << in.rdbuf();
+        return ss.str();
+    };
+    L1Datum L1d{12, {1234567, UNDEF_PRICE}, {5, 0}, {1, 0}, 1};
+    L1Datum L1d2{13, {5, 20000}, {7, 8}, {1, 1}, 0};
+
+    SECTION("raw ticks") {
+        {
+            L1CsvWriter writer(path, table, false, 16); //tiny flush size so every row goes through write(2)
+            for (int i = 0; i < 100; i++) writer.write(L1d);
+            writer.write(L1d2);
+        }
+        std::string expected = "recv_time,symbol,bid_price,bid_size,ask_price,ask_size\n";
+        for (int i = 0; i < 100; i++) expected += "12,BC,1234567,5,2147483647,0\n";
+        expected += "13,A,5,7,20000,8\n";
+        REQUIRE(readBack() == expected);
+    }
+
+    SECTION("mapped file") {
+        {
+            L1CsvWriter writer(path, table, false, 4 << 20, true);
+            for (int i = 0; i < 100; i++) writer.write(L1d);
+            writer.write(L1d2);
+        }
+        std::string expected = "recv_time,symbol,bid_price,bid_size,ask_price,ask_size\n";
+        for (int i = 0; i < 100; i++) expected += "12,BC,1234567,5,2147483647,0\n";
+        expected += "13,A,5,7,20000,8\n";
+        REQUIRE(readBack() == expected); //truncated to what was written
+    }
+
+    SECTION("fixed point prices") {
+        {
+            L1CsvWriter writer(path, table, true);
+            writer.write(L1d);
+            writer.write(L1d2);
+        }
+        REQUIRE(readBack() == "recv_time,symbol,bid_price,bid_size,ask_price,ask_size\n12,BC,123.4567,5,,0\n13,A,0.0005,7,2.0000,8\n");
+    }
+
+    SECTION("L2 deltas") {
+        bool mapped = GENERATE(false, true);
+        {
+            DeltaCsvWriter writer(path, table, 16, mapped);
+            writer.write({12, 1, B, LEVEL_ADD, {}, 1000, 10, 1});
+            writer.write({12, 1, B, LEVEL_UPDATE, {}, 1000, 25, 2});
+            writer.write({14, 0, S, LEVEL_DELETE, {}, 1100, 0, 0});
+        }
+        REQUIRE(readBack() == "exch_time,symbol,side,action,price,volume,count\n"
+            "12,BC,B,add,1000,10,1\n12,BC,B,update,1000,25,2\n14,A,S,delete,1100,0,0\n");
+    }
+
+    std::remove(path);
+}
+
+TEST_CASE("parsed prices in l1.out") {
+    Event e;
+    std::string data = R"({"exchTime":1725412500000000,"orderId":1,"price":100.85,"qty":200,"recvTime":1725412500000100,"side":"S","symbol":"C"})";
+    REQUIRE(parseEvent("NewOrder:", data, e) == NEW_ORDER);
+    REQUIRE(e.order.price == 1008500);
+
+    std::string trade = R"({"exchTime":1725412500000000,"price":0.29,"qty":50,"recvTime":1725412500000100,"symbol":"C","tradeId":"1","tradeTime":1725412500000000})";
+    REQUIRE(parseEvent("Trade:", trade, e) == TRADE);
+    REQUIRE(e.order.price == 2900); //0.29 * 10000 is 2899.99... as a double
+
+    SymbolTable table;
+    std::vector<L1Datum> updates;
+    BasicInstrument<MapBookPolicy, RecordingSink> ins("C", table.intern("C"));
+    ins.setSink({&updates});
+    REQUIRE(parseEvent("NewOrder:", data, e) == NEW_ORDER);
+    ins.addOrder(e.order);
+    REQUIRE(updates.size() == 1);
+
+    auto path = "l1_parsed_test.out";
+    {
+        L1CsvWriter writer(path, table, true);
+        writer.write(updates[0]);
+    }
+    std::ifstream in(path);
+    std::string header, row;
+    std::getline(in, header);
+    std::getline(in, row);
+    REQUIRE(row == "1725412500000000,C,,0,100.8500,200");
+    in.close();
+    std::remove(path);
+}
+
+TEST_CASE("mapped file growth") {
+    auto path = "mapped_test.out";
+    {
+        MappedFile file(path, 4096);
+        for (int i = 0; i < 3000; i++) {
+            char* p = file.reserve(10);
+            std::memcpy(p, "0123456789", 10);
+            file.commit(p + (i % 10) + 1);
+        }
+        REQUIRE(file.getSize() == 300 * 55);
+    }
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    REQUIRE(in.tellg() == 300 * 55);
+    std::remove(path);
+}
+
+TEST_CASE("binary records round trip") {
+    bool mapped = GENERATE(false, true);
+    SymbolTable table;
+    table.intern("A");
+    auto path = "l1_binary_test.bin";
+    L1Datum L1d{12, {1234567, UNDEF_PRICE}, {5, 0}, {1, 0}, 0};
+    {
+        BinaryRecordWriter<L1Datum> writer(path, "L1D1", table, mapped);
+        writer.write(L1d);
+        table.intern("BC"); //symbols first seen mid-run still make it into the footer
+        L1d.symbolId = 1;
+        writer.write(L1d);
+    }
+
+    BinaryRecordReader<L1Datum> reader(path, "L1D1");
+    REQUIRE(reader.getHeader().priceFactor == PRICE_FACTOR);
+    REQUIRE(reader.getSymbols().size() == 2);
+    REQUIRE(reader.getSymbols().name(1) == "BC");
+    L1Datum read;
+    REQUIRE(reader.read(read));
+    REQUIRE(read.symbolId == 0);
+    REQUIRE(reader.read(read));
+    REQUIRE(read.symbolId == 1);
+    REQUIRE(read.exchTime == 12);
+    REQUIRE(read.price[1] == UNDEF_PRICE);
+    REQUIRE_FALSE(reader.read(read));
+
+    REQUIRE_THROWS_AS(BinaryRecordReader<L1Datum>(path, "L2D1"), std::runtime_error);
+    std::remove(path);
+}
+
+//the bytes BinaryRecordWriter writes for record when it's built in memory first filled with fill, so any padding would carry that
+template<class Record>
+std::string binaryFileBytes(Record const& record, const char (&magic)[5], unsigned char fill) {
+    SymbolTable table;
+    table.intern("A");
+    auto path = "binary_bytes_test.bin";
+    {
+        alignas(Record) unsigned char raw[sizeof(Record)];
+        std::memset(raw, fill, sizeof raw);
+        auto copy = new (raw) Record(record);
+        BinaryRecordWriter<Record> writer(path, magic, table);
+        writer.write(*copy);
+    }
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    std::remove(path);
+    return ss.str();
+}
+
+TEST_CASE("binary records don't depend on leftover memory") {
+    LevelDelta delta{7, 0, S, LEVEL_UPDATE, {}, 1000, 10, 1};
+    REQUIRE(binaryFileBytes(delta, "L2D1", 0x00) == binaryFileBytes(delta, "L2D1", 0xff));
+    L1Datum L1d{12, {1234567, UNDEF_PRICE}, {5, 0}, {1, 0}, 0};
+    REQUIRE(binaryFileBytes(L1d, "L1D1", 0x00) == binaryFileBytes(L1d, "L1D1", 0xff));
+}
+
+TEST_CASE("binary prices rescale with the header's factor") {
+    Event e;
+    std::string data = R"({"exchTime":1725412500000000,"orderId":1,"price":100.85,"qty":200,"recvTime":1725412500000100,"side":"S","symbol":"C"})";
+    REQUIRE(parseEvent("NewOrder:", data, e) == NEW_ORDER);
+    SymbolTable table;
+    std::vector<L1Datum> updates;
+    BasicInstrument<MapBookPolicy, RecordingSink> ins("C", table.intern("C"));
+    ins.setSink({&updates});
+    ins.addOrder(e.order);
+    REQUIRE(updates.size() == 1);
+
+    auto path = "l1_parsed_test.bin";
+    {
+        BinaryRecordWriter<L1Datum> writer(path, "L1D1", table);
+        writer.write(updates[0]);
+    }
+    BinaryRecordReader<L1Datum> reader(path, "L1D1");
+    L1Datum read;
+    REQUIRE(reader.read(read));
+    REQUIRE((double) read.price[S] / reader.getHeader().priceFactor == Approx(100.85));
+    REQUIRE(read.volume[S] == 200);
+    REQUIRE(reader.getSymbols().name(read.symbolId) == "C");
+    std::remove(path);
+}
+
+TEST_CASE("consumer wait policies") {
+    auto policy = GENERATE(WaitPolicy::SPIN_YIELD, WaitPolicy::SPIN_PARK);
+    SpscRing<L1Datum> ring(64);
+    OverflowStats stats;
+    WakeSignal wake;
+    const timestamp N = 20000;
+
+    std::thread producer([&]() {
+        L1Outbox outbox(ring, OverflowPolicy::BLOCK, stats, 0, &wake);
+        for (timestamp t = 1; t <= N; t++) {
+            outbox.push(L1Datum{t, {}, {}, {}, 0});
+            if (t % 100 == 0) {
+                wake.notify();
+                std::this_thread::yield(); //gives the consumer time to run dry and park
+            }
+        }
+        ring.close();
+        wake.notify();
+    });
+
+    Waiter waiter(policy, wake, 0);
+    timestamp expected = 1;
+    bool inOrder = true;
+    L1Datum L1d;
+    while (true) {
+        if (ring.tryPop(L1d)) {
+            inOrder &= L1d.exchTime == expected++;
+            waiter.reset();
+        } else if (ring.closed()) {
+            while (ring.tryPop(L1d)) inOrder &= L1d.exchTime == expected++;
+            break;
+        } else {
+            waiter.idle([&]() { return ring.peek() != nullptr || ring.closed(); });
+        }
+    }
+    producer.join();
+    REQUIRE(inOrder);
+    REQUIRE(expected == N + 1);
+
+    WaitPolicy parsed;
+    REQUIRE(parseWaitPolicy("spin_park", parsed));
+    REQUIRE(parsed == WaitPolicy::SPIN_PARK);
+    REQUIRE_FALSE(parseWaitPolicy("nap", parsed));
+}
+
+TEST_CASE("CPU lists") {
+    REQUIRE(parseCpuList("") == std::vector<int>{});
+    REQUIRE(parseCpuList("3") == std::vector<int>{3});
+    REQUIRE(parseCpuList("0,2-4,7") == std::vector<int>{0, 2, 3, 4, 7});
+    REQUIRE(parseCpuList("1,x,5") == std::vector<int>{1, 5});
+}
+
+TEST_CASE("CPU list formatting") {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    REQUIRE(formatCpuList(set) == "");
+    for (int cpu : parseCpuList("0-2,5,7-8")) CPU_SET(cpu, &set);
+    REQUIRE(formatCpuList(set) == "0-2,5,7-8");
+}
+
+TEST_CASE("thread placement isn't inherited") {
+    auto path = "placement_test.cfg";
+    {
+        std::ofstream cfg(path);
+        cfg << "cpu.outer=0\nrt.outer=1\n"; //rt.outer may well fail without privileges; the inner thread must not inherit it either way
+    }
+    Config config(path);
+    std::remove(path);
+
+    cpu_set_t outerCpus, innerCpus;
+    int innerPolicy = -1;
+    std::thread outer([&]() {
+        placeThread(config, "outer");
+        sched_getaffinity(0, sizeof outerCpus, &outerCpus);
+        std::thread inner([&]() {
+            placeThread(config, "inner");
+            sched_getaffinity(0, sizeof innerCpus, &innerCpus);
+            sched_param param;
+            pthread_getschedparam(pthread_self(), &innerPolicy, &param);
+        });
+        inner.join();
+    });
+    outer.join();
+    REQUIRE(formatCpuList(outerCpus) == "0");
+    REQUIRE(formatCpuList(innerCpus) == formatCpuList(processPlacement.cpus));
+    REQUIRE(innerPolicy == processPlacement.policy);
+}
+
+using TestBook = std::variant<BasicInstrument<MapBookPolicy, WriteBufferSink>>;
+
+//a BookWorker wired to producer 0 of a one-producer writer queue
+struct WorkerFixture {
+    MultiSpscQueue<L1Datum> queue{1, 64};
+    OverflowStats stats;
+    L1Outbox outbox;
+    WakeSignal wake;
+    std::deque<TestBook> books;
+    BookWorker<TestBook> worker;
+
+    WorkerFixture(BatchSettings settings, SubscriptionRegistry* subscriptions = nullptr, OverflowPolicy policy = OverflowPolicy::BLOCK)
+        : outbox(queue.producer(0), policy, stats) {
+        worker.link = {&queue, &outbox, nullptr, nullptr, &wake};
+        worker.settings = settings;
+        worker.subscriptions = subscriptions;
+        for (symbol_id id = 0; id < 2; id++) {
+            books.emplace_back(std::in_place_index<0>, std::string(1, 'A' + id), id);
+            worker.assign(books.back());
+        }
+    }
+
+    void apply(EventType type, Order const& order) {
+        worker.apply(Event{type, order}, &books[order.symbol[0] - 'A']);
+    }
+
+    std::vector<L1Datum> delivered() {
+        std::vector<L1Datum> out;
+        L1Datum L1d;
+        while (queue.tryPop(L1d)) out.push_back(L1d);
+        return out;
+    }
+};
+
+TEST_CASE("book worker batches and flushes") {
+    SECTION("exch_time batches emit once per book, on the next exchTime") {
+        WorkerFixture f({true, true, 64, std::chrono::microseconds(1000000)});
+        f.apply(NEW_ORDER, {1, 10, 1000, 10, B, "A"});
+        f.apply(NEW_ORDER, {2, 10, 1010, 10, B, "A"});
+        f.apply(NEW_ORDER, {3, 10, 1100, 10, S, "B"});
+        f.worker.flush();
+        REQUIRE(f.delivered().empty()); //batch still open
+        f.apply(NEW_ORDER, {4, 20, 990, 10, B, "A"});
+        f.worker.flush();
+        auto out = f.delivered();
+        REQUIRE(out.size() == 2);
+        REQUIRE(out[0].symbolId == 0);
+        REQUIRE(out[0].price[B] == 1010);
+        REQUIRE(out[1].symbolId == 1);
+        f.worker.finish();
+        REQUIRE(f.delivered().empty()); //the order at 20 didn't move A's touch
+        REQUIRE(f.queue.closed());
+    }
+
+    SECTION("marker batches close only at BatchEnd") {
+        WorkerFixture f({true, false, 64, std::chrono::microseconds(1000000)});
+        f.apply(NEW_ORDER, {1, 10, 1000, 10, B, "A"});
+        f.apply(NEW_ORDER, {2, 20, 1010, 10, B, "A"});
+        f.worker.flush();
+        REQUIRE(f.delivered().empty());
+        f.worker.apply(Event{BATCH_END, {}}, nullptr);
+        f.worker.flush();
+        auto out = f.delivered();
+        REQUIRE(out.size() == 1);
+        REQUIRE(out[0].exchTime == 20);
+
+        //books are stamped with their own last change and come out in that order, not the order they joined the batch
+        f.apply(NEW_ORDER, {3, 30, 1020, 10, B, "A"});
+        f.apply(NEW_ORDER, {4, 40, 1100, 10, S, "B"});
+        f.apply(NEW_ORDER, {5, 50, 1030, 10, B, "A"});
+        f.worker.apply(Event{BATCH_END, {}}, nullptr);
+        f.worker.flush();
+        out = f.delivered();
+        REQUIRE(out.size() == 2);
+        REQUIRE(out[0].symbolId == 1);
+        REQUIRE(out[0].exchTime == 40);
+        REQUIRE(out[1].symbolId == 0);
+        REQUIRE(out[1].exchTime == 50);
+    }
+
+    SECTION("unbatched updates go out every flushEvents events") {
+        WorkerFixture f({false, false, 2, std::chrono::microseconds(1000000)});
+        f.worker.countEvent();
+        f.apply(NEW_ORDER, {1, 10, 1000, 10, B, "A"});
+        REQUIRE(f.delivered().empty());
+        f.worker.countEvent();
+        REQUIRE(f.delivered().size() == 1);
+    }
+
+    SECTION("caught up: old batches close and the watermark moves") {
+        WorkerFixture f({true, true, 64, std::chrono::microseconds(1000000)});
+        f.apply(NEW_ORDER, {1, 10, 1000, 10, B, "A"});
+        f.worker.caughtUp(10); //more events at 10 may still come
+        REQUIRE(f.delivered().empty());
+        f.worker.caughtUp(11);
+        REQUIRE(f.delivered().size() == 1);
+    }
+
+    SECTION("caught up: updates the outbox held back go out once there's room, then the watermark moves") {
+        WorkerFixture f({false, false, 1, std::chrono::microseconds(1000000)}, nullptr, OverflowPolicy::DROP_OLDEST);
+        for (int i = 1; i <= 67; i++) {
+            f.apply(NEW_ORDER, {i, (timestamp) i, 1000 + i, 10, B, "A"});
+            f.worker.countEvent();
+        }
+        REQUIRE(f.outbox.held() == 3); //the ring holds 64
+        REQUIRE_FALSE(f.worker.caughtUp(67));
+        REQUIRE(f.delivered().size() == 64);
+        REQUIRE(f.worker.caughtUp(67));
+        REQUIRE(f.outbox.held() == 0);
+        L1Datum L1d;
+        for (timestamp t = 65; t <= 67; t++) {
+            REQUIRE(f.queue.tryPopOrdered(L1d, [](L1Datum const& d) { return d.exchTime; }));
+            REQUIRE(L1d.exchTime == t);
+        }
+        REQUIRE(f.stats.dropped == 0);
+    }
+}
+
+//two BookWorkers on producers 0 and 1 of the writer queues, each with one book (A and B) producing L2 deltas
+struct TwoWorkerFixture {
+    MultiSpscQueue<L1Datum> l1Queue{2, 16};
+    MultiSpscQueue<LevelDelta> l2Queue{2, 16};
+    OverflowStats stats;
+    std::deque<L1Outbox> l1Outboxes;
+    std::deque<Outbox<LevelDelta>> l2Outboxes;
+    WakeSignal wake;
+    std::deque<TestBook> books;
+    BookWorker<TestBook> workers[2];
+
+    TwoWorkerFixture(BatchSettings settings) {
+        for (std::size_t s = 0; s < 2; s++) {
+            l1Outboxes.emplace_back(l1Queue.producer(s), OverflowPolicy::BLOCK, stats);
+            l2Outboxes.emplace_back(l2Queue.producer(s), OverflowPolicy::BLOCK, stats);
+            workers[s].producer = s;
+            workers[s].link = {&l1Queue, &l1Outboxes[s], &l2Queue, &l2Outboxes[s], &wake};
+            workers[s].settings = settings;
+            books.emplace_back(std::in_place_index<0>, std::string(1, 'A' + s), s);
+            std::visit([](auto& i) { i.enableDeltas(); }, books.back());
+            workers[s].assign(books.back());
+        }
+    }
+
+    //book A goes to worker 0, B to worker 1
+    void apply(EventType type, Order const& order) {
+        std::size_t s = order.symbol[0] - 'A';
+        workers[s].apply(Event{type, order}, &books[s]);
+    }
+};
+
+TEST_CASE("an idle shard's open marker batch doesn't hold up ordered L2") {
+    TwoWorkerFixture f({true, false, 64, std::chrono::microseconds(1000000)});
+    f.apply(NEW_ORDER, {1, 1, 1000, 10, B, "B"});
+    f.workers[1].caughtUp(1); //then idle, its marker batch open
+    for (int t = 1; t <= 10; t++) {
+        f.apply(NEW_ORDER, {t + 1, (timestamp) t, 1000 + t, 10, B, "A"});
+        f.workers[0].caughtUp(t);
+    }
+    f.workers[1].caughtUp(10);
+
+    std::vector<timestamp> times;
+    LevelDelta delta;
+    while (f.l2Queue.tryPopOrdered(delta, [](LevelDelta const& d) { return d.exchTime; })) times.push_back(delta.exchTime);
+    REQUIRE(times.size() == 11);
+    REQUIRE(std::is_sorted(times.begin(), times.end()));
+
+    L1Datum L1d;
+    REQUIRE_FALSE(f.l1Queue.tryPopOrdered(L1d, [](L1Datum const& d) { return d.exchTime; })); //both batches still open
+    for (auto& worker : f.workers) {
+        worker.apply(Event{BATCH_END, {}}, nullptr);
+        worker.caughtUp(10);
+    }
+    REQUIRE(f.l1Queue.tryPopOrdered(L1d, [](L1Datum const& d) { return d.exchTime; }));
+    REQUIRE(L1d.symbolId == 1);
+    REQUIRE(f.l1Queue.tryPopOrdered(L1d, [](L1Datum const& d) { return d.exchTime; }));
+    REQUIRE(L1d.symbolId == 0);
+    REQUIRE(L1d.exchTime == 10);
+}
+
+TEST_CASE("book worker publishes depth per batch") {
+    SubscriptionRegistry registry;
+    auto& sub = registry.subscribe({0}, DEPTH_UPDATES);
+    WorkerFixture f({true, true, 64, std::chrono::microseconds(1000000)}, &registry);
+    DepthDatum depth;
+
+    f.apply(NEW_ORDER, {1, 10, 1000, 10, B, "A"});
+    f.apply(NEW_ORDER, {2, 10, 1010, 10, B, "A"});
+    f.apply(ORDER_CANCELED, {1, 10, 0, 0, B, "A"});
+    REQUIRE_FALSE(sub.poll(depth));
+    f.apply(NEW_ORDER, {3, 20, 1100, 10, S, "B"}); //the next exchTime closes the batch
+    REQUIRE(sub.poll(depth));
+    REQUIRE(depth.exchTime == 10); //the closed batch's, like its L1 update
+    REQUIRE(depth.bidLevels == 1);
+    REQUIRE(depth.bids[0].price == 1010);
+    REQUIRE_FALSE(sub.poll(depth));
+    f.worker.flush();
+    auto L1 = f.delivered();
+    REQUIRE(L1.size() == 1);
+    REQUIRE(L1[0].exchTime == depth.exchTime);
+
+    f.worker.apply(Event{BATCH_END, {}}, nullptr);
+    REQUIRE_FALSE(sub.poll(depth)); //nobody subscribed to B
+}
+
+TEST_CASE("shard balancing") {
+    //busiest first, each to the least loaded shard; symbols past counts (or at 0) count as one
+    REQUIRE(balanceShards(4, {10, 1, 5, 0}, 2) == std::vector<std::size_t>{0, 1, 1, 1});
+    REQUIRE(balanceShards(5, {3, 3, 3}, 3) == std::vector<std::size_t>{0, 1, 2, 0, 1});
+    REQUIRE(balanceShards(2, {}, 4) == std::vector<std::size_t>{0, 1});
+}
+
+TEST_CASE("sharded books match one worker") {
+    auto policy = GENERATE(WaitPolicy::SPIN_YIELD, WaitPolicy::SPIN_PARK);
+    const std::size_t SYMBOLS = 4, SHARDS = 2;
+    BatchSettings settings{true, true, 8, std::chrono::microseconds(100)};
+
+    //a few thousand orders over SYMBOLS symbols, two events per exchTime, every other one cancelled later
+    std::vector<Event> events;
+    for (int i = 0; i < 4000; i++) {
+        timestamp t = i / 2;
+        if (i % 3 == 2) {
+            events.push_back(Event{ORDER_CANCELED, {i - 2, t, 0, 0, B, std::string(1, 'A' + (i - 2) % SYMBOLS)}});
+            continue;
+        }
+        std::string sym(1, 'A' + i % SYMBOLS);
+        events.push_back(Event{NEW_ORDER, {i, t, 1000 + (i * 7) % 50 * (i % 2 ? 1 : -1), 10, i % 2 ? S : B, sym}});
+    }
+    auto symbolOf = [](Event const& e) { return (symbol_id) (e.order.symbol[0] - 'A'); };
+
+    //reference: everything on one worker
+    std::multiset<std::tuple<timestamp, symbol_id, int, int>> expected;
+    {
+        WorkerFixture f(settings);
+        for (symbol_id id = 2; id < SYMBOLS; id++) {
+            f.books.emplace_back(std::in_place_index<0>, std::string(1, 'A' + id), id);
+            f.worker.assign(f.books.back());
+        }
+        for (auto const& e : events) {
+            f.worker.apply(e, &f.books[symbolOf(e)]);
+            f.worker.flush();
+            for (auto const& L1d : f.delivered()) expected.insert({L1d.exchTime, L1d.symbolId, L1d.price[B], L1d.price[S]});
+        }
+        f.worker.finish();
+        for (auto const& L1d : f.delivered()) expected.insert({L1d.exchTime, L1d.symbolId, L1d.price[B], L1d.price[S]});
+    }
+
+    MultiSpscQueue<L1Datum> queue(SHARDS, 16);
+    OverflowStats stats;
+    std::vector<L1Outbox> outboxes;
+    for (std::size_t s = 0; s < SHARDS; s++) outboxes.emplace_back(queue.producer(s), OverflowPolicy::BLOCK, stats);
+    WakeSignal wake;
+    std::deque<TestBook> books;
+    std::vector<std::unique_ptr<BookShard<TestBook>>> shards;
+    for (std::size_t s = 0; s < SHARDS; s++) {
+        shards.push_back(std::make_unique<BookShard<TestBook>>(32, policy, 10));
+        auto& worker = shards.back()->worker;
+        worker.producer = s;
+        worker.link = {&queue, &outboxes[s], nullptr, nullptr, &wake};
+        worker.settings = settings;
+    }
+    auto assigned = balanceShards(SYMBOLS, {}, SHARDS);
+    for (symbol_id id = 0; id < SYMBOLS; id++) {
+        books.emplace_back(std::in_place_index<0>, std::string(1, 'A' + id), id);
+        shards[assigned[id]]->worker.assign(books.back());
+    }
+
+    std::atomic<timestamp> parsedUpTo{0};
+    std::vector<std::thread> threads;
+    for (auto& shard : shards) threads.emplace_back([&, s = shard.get()]() { s->run(parsedUpTo); });
+
+    std::vector<L1Datum> merged;
+    std::thread writer([&]() {
+        L1Datum L1d;
+        while (true) {
+            if (queue.tryPopOrdered(L1d, [](L1Datum const& d) { return d.exchTime; })) merged.push_back(L1d);
+            else if (queue.closed() && queue.empty()) return;
+            else std::this_thread::yield();
+        }
+    });
+    for (auto const& e : events) {
+        auto id = symbolOf(e);
+        shards[assigned[id]]->push({e, &books[id]});
+        if (e.order.exchTime != parsedUpTo.load()) {
+            parsedUpTo.store(e.order.exchTime);
+            for (auto& shard : shards) shard->wakeUp();
+        }
+    }
+    for (auto& shard : shards) shard->close();
+    for (auto& t : threads) t.join();
+    writer.join();
+
+    std::multiset<std::tuple<timestamp, symbol_id, int, int>> got;
+    bool inOrder = true;
+    for (std::size_t i = 0; i < merged.size(); i++) {
+        got.insert({merged[i].exchTime, merged[i].symbolId, merged[i].price[B], merged[i].price[S]});
+        inOrder &= i == 0 || merged[i - 1].exchTime <= merged[i].exchTime;
+    }
+    REQUIRE(!expected.empty());
+    REQUIRE(got == expected);
+    REQUIRE(inOrder);
+}